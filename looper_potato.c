@@ -6,22 +6,31 @@
  * indicators of where we are in the tune.
  */
 
+#define _GNU_SOURCE /* for MAP_HUGETLB and friends */
+
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
+#include <time.h>
 #include <jack/jack.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 
 /* if we have four sound sources (mic, three buffers) then we should
    divide all sounds by 4 before giving them to the speaker.
-   Unfortunately, that's too soft on my system, so we only divide by
-   2.  There is some danger of clipping. */
+   Unfortunately, that's too soft on my system.  Now that the output
+   goes through a limiter we can leave everything at full volume. */
 #define VOLUME_DECREASE 1
 
 /* hardcoded sample rate so we can make buffer sizes depend on the
@@ -32,16 +41,19 @@
 /* how long one buffer is */
 #define AMT_MEM SECONDS_OF_RECORDING*SAMPLE_RATE
 
-/* there are three loop buffers represented in loop_bufs.  They are at
-   offsets 0, AMT_MEM, and 2*AMT_MEM */
-jack_default_audio_sample_t loop_bufs[AMT_MEM*3]; // three buffers
+/* back the audio buffers with huge pages if the kernel will give us
+   any.  We ask for explicit MAP_HUGETLB pages first and fall back to
+   transparent huge pages.  Set to 0 to use ordinary pages. */
+#define USE_HUGE_PAGES 1
+#define HUGE_PAGE_SIZE (2*1024*1024)
 
 /* where in the loop buffer we're playing/recording from.  We start at
    0 when we record the first loop.*/
 int loop_pos = 0;
 
 /* where in the loop buffer to go back around to the beginning again.
-   Will be a multiple of nframes 
+   Doesn't need to be a multiple of nframes: everything that reads or
+   writes the loop goes through a ring.
    
    loop_end will be 64 beats times the interbeat sample length.
 
@@ -65,20 +77,23 @@ int loop_end = 0;
 #define MOUSE_None -1
 
 /*** jack stuff ***/
-jack_port_t *input_port;
 jack_port_t *output_port;
 jack_client_t *client;
 
+/* give each track, and the dry input, its own output port as well as
+   summing everything into output, so they can be mixed separately.
+   Set to 0 for just the one output. */
+#define TRACK_PORTS 1
+
 /*** mouse stuff ***/
 #define MAX_MOUSE_READ 1024
 int amt_read_mouse = 0;
 char mouse_buf[MAX_MOUSE_READ];
-int mouse_fd;
 
 /*** state stuff ***/
 
-/* we have two kinds of state: main (int state) and per pedal (int
-   pedal_states[3]).  Allowed states are:
+/* we have two kinds of state: main (int state) and per pedal (each
+   musician's pedal_states[3]).  Allowed states are:
 
    main     pedal_state
    ----     -----------
@@ -119,19 +134,1000 @@ int state = S_OFF;
 #define pS_REC    1 /* we're recording to the buffer for this pedal */
 #define pS_PLY    3 /* we're playing from the buffer for this pedal */
 
-/* individual pedal states.  If the main state is OFF then these are
-   ignored. */
-int pedal_states[3];
+/* we keep a running history of the input so that a pedal pressed a
+   little after the top of the loop can still record the whole loop.
+   HISTORY_LEN is how much input we keep, LATE_WINDOW is how long
+   after the top of the loop a press still counts as "at the top".
+   LATE_WINDOW must not be longer than HISTORY_LEN. */
+#define HISTORY_LEN (SAMPLE_RATE*4)
+#define LATE_WINDOW (SAMPLE_RATE/2)
+
+/*** musician stuff ***/
+
+/* Several musicians can share one looper: give it a mouse for each.
+   Each musician has their own input port, pedals, three tracks and
+   output ports, but there's only one tune: one tempo, one loop_pos,
+   one click, and one output with everything in it.  process() runs
+   them all in the same call, so they can't drift apart, and jack only
+   has the one client to wake up.
+
+   Anyone's pedals can set the tempo, and we only go back to OFF when
+   everyone's pedals are off.  Pedals are printed as musician.pedal. */
+#define MAX_MUSICIANS 4
+
+struct musician {
+  int id;
+  int mouse_fd;
+  jack_port_t *input_port;
+  jack_port_t *track_ports[3];
+  jack_port_t *dry_port;
+
+  /* individual pedal states.  If the main state is OFF then these
+     are ignored. */
+  int pedal_states[3];
+
+  /* bumped whenever a pedal goes off, so that anything it still had
+     pending is ignored */
+  int pedal_gen[3];
+
+  /* see section stuff */
+  int track_split[3];
+
+  /* a loop buffer for each track, a spare one to record a
+     replacement into (see respond_to_replace()), and the input
+     history.
+     Allocated, locked, and prefaulted by alloc_audio_mem() before we
+     go realtime. */
+  jack_default_audio_sample_t *track_bufs[3];
+  jack_default_audio_sample_t *spare;
+  jack_default_audio_sample_t *history;
+  int history_pos; /* where the next input sample goes */
+
+  int replacing;    /* the pedal we're replacing, or -1 */
+  int replace_rec;  /* whether the replacement is recording yet */
+  int spare_split;  /* the replacement's track_split */
+
+  /* this cycle's port buffers, and how far into the block each track
+     port has been written (TRACK_PORTS only) */
+  jack_default_audio_sample_t *in;
+  jack_default_audio_sample_t *track_out[3];
+  int played[3];
+};
+
+struct musician musicians[MAX_MUSICIANS];
+int n_musicians = 0;
+
+/*** click stuff ***/
+
+/* the metronome is a short click mixed into its own jack port at the
+   exact frame of each beat, so it can go to whoever needs it (the
+   drummer's in-ear mix, say) without going to the PA.  The top of each
+   part (A1, A2, B1, B2) gets a higher, louder accent click. */
+
+/* 0 to click only while nothing's playing (a count-in for the first
+   track), 1 to click the whole time */
+#define CLICK_ALWAYS 1
+
+#define CLICK_LEN (SAMPLE_RATE/50) /* 20ms */
+#define CLICK_FREQ 1500
+#define ACCENT_FREQ 2500
+#define CLICK_LEVEL 0.3
+#define ACCENT_LEVEL 0.6
+
+jack_port_t *click_port;
+
+jack_default_audio_sample_t click_wave[CLICK_LEN];
+jack_default_audio_sample_t accent_wave[CLICK_LEN];
+
+/* the click that's sounding and how far through it we are */
+jack_default_audio_sample_t *click_playing = NULL;
+int click_pos = 0;
+
+/* a decaying sine, worked out once at startup */
+void make_click(jack_default_audio_sample_t *wave, float freq, float level)
+{
+  for (int i = 0 ; i < CLICK_LEN ; i++) {
+    wave[i] = level * sinf(2 * M_PI * freq * i / SAMPLE_RATE) *
+      expf(-8.0 * i / CLICK_LEN);
+  }
+}
+
+/* copy as much of the sounding click as fits into out[start, nframes) */
+void click_continue(jack_default_audio_sample_t *out, int start, int nframes)
+{
+  int n = CLICK_LEN - click_pos;
+  if (n > nframes - start) { n = nframes - start; }
+
+  memcpy(out + start, click_playing + click_pos, n * sizeof(*out));
+  click_pos += n;
+  if (click_pos == CLICK_LEN) { click_playing = NULL; }
+}
+
+/* fill the click port for this block.  Beats are every loop_end/64
+   samples from the top of the loop; we find the ones that land in
+   this block and start a click at each.  When nothing is sounding
+   and no beat lands here all we do is clear the buffer. */
+void click_block(jack_default_audio_sample_t *out, int nframes, int sounding)
+{
+  int beat_len = loop_end / 64;
+
+  memset(out, 0, nframes * sizeof(*out));
+  if (click_playing) { click_continue(out, 0, nframes); }
+  if (!sounding || beat_len == 0) { return; }
+
+  /* the first beat at or after loop_pos, which might be the top of
+     the next time through */
+  int beat = (loop_pos + beat_len - 1) / beat_len;
+  int beat_pos = beat * beat_len;
+  if (beat >= 64) {
+    beat = 0;
+    beat_pos = loop_end;
+  }
+
+  while (beat_pos < loop_pos + nframes) {
+    click_playing = beat % 16 == 0 ? accent_wave : click_wave;
+    click_pos = 0;
+    click_continue(out, beat_pos - loop_pos, nframes);
+
+    if (++beat == 64) {
+      beat = 0;
+      beat_pos = loop_end;
+    }
+    else {
+      beat_pos += beat_len;
+    }
+  }
+}
+
+/*** schedule stuff ***/
+
+/* Pedal actions don't have to happen right away: they can wait for
+   the next beat, bar, part (A1, A2, B1, B2) or the top of the tune.
+   Pending actions sit in a small preallocated heap ordered by the
+   frame they're due at, and process() only looks at the heap when
+   the earliest one is due inside the block it's working on.  Frames
+   count up from the start of the tune so they never wrap. */
+
+/* how far apart, in beats, the points an action can wait for are */
+#define Q_NOW      0
+#define Q_BEAT     1
+#define Q_BAR      4
+#define Q_PART    16
+#define Q_TUNE    64
+
+/* what a pedal waits for before it starts recording, and before it
+   stops.  A recording always runs for one time through the tune, so
+   starting at a part records from there round to the same part. */
+#define REC_QUANTUM Q_TUNE
+#define OFF_QUANTUM Q_NOW
+
+#define ACT_REC 1 /* start recording */
+#define ACT_PLY 2 /* done recording, start playing */
+#define ACT_OFF 3 /* stop recording or playing */
+#define ACT_JUMP 4 /* jump to cued_part (nobody's pedal) */
+#define ACT_PAD 5 /* start the pad in pedal (nobody's pedal either) */
+#define ACT_SHADOW 6 /* start recording a replacement for a playing track */
+#define ACT_SWAP 7 /* the replacement's done: swap it in */
+
+/* Each pedal has at most one ACT_REC or ACT_PLY pending and one
+   ACT_OFF, each musician one ACT_SHADOW or ACT_SWAP, each pad one
+   ACT_PAD, and there's one ACT_JUMP.  Turning a pedal off takes its
+   others out of the heap, so it never fills. */
+#define MAX_ACTIONS (MAX_MUSICIANS * (3 * 2 + 1) + 3 + 1)
+
+struct action {
+  long long frame; /* when it's due, in tune_frame terms */
+  int what;
+  int who;         /* which musician */
+  int pedal;
+  int gen;         /* their pedal_gen[pedal] when this was scheduled */
+};
+
+/* a binary heap: actions[0] is always the next one due */
+struct action actions[MAX_ACTIONS];
+int n_actions = 0;
+
+/* frames since the tune started */
+long long tune_frame = 0;
+
+void push_action(struct action a)
+{
+  if (n_actions == MAX_ACTIONS) {
+    printf("too many pending actions, dropping one for %d.%d\n", a.who, a.pedal);
+    return;
+  }
+
+  int i = n_actions++;
+  while (i > 0 && actions[(i - 1) / 2].frame > a.frame) {
+    actions[i] = actions[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  actions[i] = a;
+}
+
+void schedule(long long frame, int what, struct musician *m, int pedal)
+{
+  struct action a = {frame, what, m->id, pedal, m->pedal_gen[pedal]};
+  push_action(a);
+}
+
+/* whether there's already a what pending for this pedal (or pad) */
+int scheduled(int what, struct musician *m, int pedal)
+{
+  for (int i = 0 ; i < n_actions ; i++) {
+    if (actions[i].what == what && actions[i].who == m->id &&
+	actions[i].pedal == pedal) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* take out everything pending for a pedal that's just been turned
+   off.  It would all be ignored when it came due anyway, but until
+   then it's taking up room. */
+void unschedule_pedal(struct musician *m, int pedal)
+{
+  struct action keep[MAX_ACTIONS];
+  int n = 0;
+
+  for (int i = 0 ; i < n_actions ; i++) {
+    struct action *a = &actions[i];
+    if (a->what == ACT_JUMP || a->what == ACT_PAD ||
+	a->who != m->id || a->pedal != pedal) {
+      keep[n++] = *a;
+    }
+  }
+  n_actions = 0;
+  for (int i = 0 ; i < n ; i++) {
+    push_action(keep[i]);
+  }
+}
+
+struct action unschedule()
+{
+  struct action next = actions[0];
+  struct action last = actions[--n_actions];
+  int i = 0;
+
+  while (2 * i + 1 < n_actions) {
+    int child = 2 * i + 1;
+    if (child + 1 < n_actions && actions[child + 1].frame < actions[child].frame) {
+      child++;
+    }
+    if (last.frame <= actions[child].frame) { break; }
+    actions[i] = actions[child];
+    i = child;
+  }
+  actions[i] = last;
+  return next;
+}
+
+/* the points an action can wait for are every quantum beats from the
+   top, and the top itself (the last beat soaks up any remainder when
+   loop_end isn't a multiple of 64) */
+int quantum_len(int quantum)
+{
+  return quantum * (loop_end / 64);
+}
+
+/* frames from pos until the next point, 0 if we're on one */
+int until_quantum(int quantum, int pos)
+{
+  int len = quantum_len(quantum);
+  if (len == 0 || pos == 0) { return 0; }
+
+  int next = (pos + len - 1) / len * len;
+  if (next >= quantum_len(Q_TUNE)) { next = loop_end; }
+  return next - pos;
+}
+
+/* frames since the last point before pos */
+int since_quantum(int quantum, int pos)
+{
+  int len = quantum_len(quantum);
+  if (len == 0) { return 0; }
+  return pos % len;
+}
+
+/*** section stuff ***/
+
+/* Tunes are AABB: A1 and A2 are the same 16 beats, and so are B1 and
+   B2.  Usually a track plays them the same too, so by default it only
+   records the first time through each part and plays that back for
+   the repeat.  While it's still recording you hear your A1 back during
+   A2, and the same for B.
+
+   If the repeat should be different, tap the pedal during it while
+   the track is still recording, and the track records everything from
+   the top of that part on (a tap up to LATE_WINDOW late still gets
+   the top).  Tap again to turn it off as usual.  A take that doesn't
+   start at the top of the tune records everything.
+
+   Each part is kept where it was first played, so switching doesn't
+   copy anything: a track just has a split point, and a repeat before
+   that plays from its first time through. */
+#define SECTIONS 1 /* 0 to always record the whole tune */
+
+#define N_PARTS 4
+/* for each part, the one that has the same section the first time */
+const int first_part[N_PARTS] = {0, 0, 2, 2};
+const char *part_names[N_PARTS] = {"A1", "A2", "B1", "B2"};
+
+/* where each part starts, worked out once when we get a tempo.  The
+   last entry is loop_end, so part p is [part_start[p],
+   part_start[p+1]). */
+int part_start[N_PARTS + 1];
+
+void index_tune()
+{
+  for (int part = 0 ; part < N_PARTS ; part++) {
+    part_start[part] = part * quantum_len(Q_PART);
+  }
+  part_start[N_PARTS] = loop_end;
+}
+
+/* which part pos is in */
+int part_of(int pos)
+{
+  int part = 0;
+  while (part < N_PARTS - 1 && pos >= part_start[part + 1]) { part++; }
+  return part;
+}
+
+/* Each take has a split: repeats at or after it are the take's own,
+   and a split of loop_end plays every repeat from the first time
+   through.  Each musician has a track_split[] per track. */
+
+/* the split for a take starting at frame */
+int take_split(long long frame)
+{
+  return SECTIONS && frame % loop_end == 0 ? loop_end : 0;
+}
+
+/* a take is starting at frame */
+void take_start(struct musician *m, int pedal, long long frame)
+{
+  m->track_split[pedal] = take_split(frame);
+}
+
+/* where in its buffer a take with this split plays pos in the tune
+   from */
+int split_pos(int split, int pos)
+{
+  int part = part_of(pos);
+
+  if (pos >= split) { return pos; }
+  return pos - (part_start[part] - part_start[first_part[part]]);
+}
+
+/* how far from pos, up to n, before split_pos() might jump */
+int split_run(int split, int pos, int n)
+{
+  int run = part_start[part_of(pos) + 1] - pos;
+
+  if (split > pos && split - pos < run) { run = split - pos; }
+  return run < n ? run : n;
+}
+
+int track_pos(struct musician *m, int pedal, int pos)
+{
+  return split_pos(m->track_split[pedal], pos);
+}
+
+int part_run(struct musician *m, int pedal, int pos, int n)
+{
+  return split_run(m->track_split[pedal], pos, n);
+}
+
+/*** jump stuff ***/
+
+/* When the dancers or the band skip or repeat a part, we follow them
+   instead of stopping everything.  Type the part to go to (a1, a2,
+   b1, or b2, then enter) on the terminal we're running in, and at the
+   next JUMP_QUANTUM point we carry on from the top of that part
+   instead; x cancels.  Typing another part before then changes where
+   we'll go.  The jump lands on the exact frame, and for XFADE_MS the
+   tracks crossfade from where they would have been to where they are
+   now, so there's no click.
+
+   tune_frame jumps by the same amount as loop_pos (forward for a
+   skip, back for a repeat), so anything waiting for the top of the
+   tune or a part still happens at the right place in the music.  A
+   track that's recording over a jump doesn't get what was skipped. */
+#define JUMP_QUANTUM Q_PART
+
+#define XFADE_MS 10
+#define XFADE_LEN (XFADE_MS*SAMPLE_RATE/1000)
+
+#define CUE_None   -1
+#define CUE_CANCEL -2
+
+/* the part we'll jump to, or CUE_None */
+int cued_part = CUE_None;
+int jump_pending = 0; /* whether there's an ACT_JUMP in the heap */
+
+/* while crossfading, the tracks are also played from where they would
+   have been, xfade_shift after where they are.  xfade_done counts up
+   to XFADE_LEN. */
+int xfade_shift = 0;
+int xfade_done = XFADE_LEN;
+
+/*** memory stuff ***/
+
+/* how much of the jack thread's stack to touch up front so growing
+   into it never faults */
+#define PREFAULT_STACK (256*1024)
+
+/* report how many page faults we've taken so far.  Once we're running
+   these numbers shouldn't move. */
+void print_faults(const char *when)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("page faults %s: %ld minor, %ld major\n",
+	 when, usage.ru_minflt, usage.ru_majflt);
+}
+
+/* keep len bytes at mem in ram.  If the memlock rlimit won't stretch
+   that far we say so once and carry on: a loop that might get swapped
+   out beats not starting at all. */
+void lock_buffer(void *mem, size_t len)
+{
+  static int warned = 0;
+
+  if (mlock(mem, len) && !warned) {
+    perror("mlock audio memory (raise ulimit -l?)");
+    warned = 1;
+  }
+}
+
+/* get n_samples of zeroed audio memory, on huge pages if we can.  The
+   memory is written once here so that process() never has to take a
+   fault the first time it records into a page. */
+jack_default_audio_sample_t *alloc_audio_mem(size_t n_samples)
+{
+  size_t len = n_samples * sizeof(jack_default_audio_sample_t);
+  void *mem = MAP_FAILED;
+
+#if USE_HUGE_PAGES
+  mem = mmap(NULL, (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE,
+	     PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem == MAP_FAILED) {
+    printf("no hugetlb pages, trying transparent huge pages\n");
+  }
+#endif
+  if (mem == MAP_FAILED) {
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      perror("mmap audio memory");
+      exit(1);
+    }
+#if USE_HUGE_PAGES
+    madvise(mem, len, MADV_HUGEPAGE);
+#endif
+  }
+
+  memset(mem, 0, len);
+  lock_buffer(mem, len);
+  return mem;
+}
+
+/* keep the code and libraries we have now in ram.  Only with no
+   memlock limit do we also lock everything we map later: with a limit,
+   MCL_FUTURE makes a big mmap past it fail outright instead of just
+   going unlocked.  Either way each buffer gets locked as it's mapped. */
+void lock_memory()
+{
+  struct rlimit limit;
+  int flags = MCL_CURRENT;
+
+  getrlimit(RLIMIT_MEMLOCK, &limit);
+  if (limit.rlim_cur == RLIM_INFINITY) {
+    flags |= MCL_FUTURE;
+  }
+  else {
+    printf("memlock limit %lu KB: locking buffers one at a time\n",
+	   (unsigned long)(limit.rlim_cur / 1024));
+  }
+  if (mlockall(flags)) {
+    perror("mlockall (raise ulimit -l?)");
+  }
+}
+
+/* runs in the jack thread before its first process().  Touch and lock
+   the stack it's going to grow into. */
+void thread_init(void *arg)
+{
+  volatile char stack[PREFAULT_STACK];
+
+  for (int i = 0 ; i < PREFAULT_STACK ; i += 4096) {
+    stack[i] = 0;
+  }
+  lock_buffer((void *)stack, PREFAULT_STACK);
+}
+
+/*** ring stuff ***/
+
+/* Loops, and the input history, are rings: a window of n samples
+   starting at pos can run off the end and carry on from the start.
+   ring_spans() splits a window into at most two contiguous spans so
+   the loops that do the actual work never need a modulo or a bounds
+   check, and loops don't need to be a multiple of nframes long. */
+struct ring {
+  jack_default_audio_sample_t *buf;
+  int len;
+};
+
+struct span {
+  jack_default_audio_sample_t *buf;
+  int len;
+};
+
+/* fill in the spans for [pos, pos+n) and return how many there are.
+   n must be no more than r.len */
+int ring_spans(struct ring r, int pos, int n, struct span spans[2])
+{
+  if (pos < 0 || pos >= r.len) {
+    pos %= r.len;
+    if (pos < 0) { pos += r.len; }
+  }
+
+  spans[0].buf = r.buf + pos;
+  if (n <= r.len - pos) {
+    spans[0].len = n;
+    return 1;
+  }
+  spans[0].len = r.len - pos;
+  spans[1].buf = r.buf;
+  spans[1].len = n - spans[0].len;
+  return 2;
+}
+
+/* out[0, n) += ring[pos, pos+n) * gain */
+void ring_mix(struct ring r, int pos, jack_default_audio_sample_t *out,
+	      int n, float gain)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      jack_default_audio_sample_t *src = spans[s].buf;
+      for (int i = 0 ; i < spans[s].len ; i++) {
+	out[i] += src[i] * gain;
+      }
+      out += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* out[0, n) = ring[pos, pos+n) */
+void ring_read(struct ring r, int pos, jack_default_audio_sample_t *out, int n)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      memcpy(out, spans[s].buf, spans[s].len * sizeof(*out));
+      out += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* out[0, n) = ring[pos, pos+n) * gain */
+void ring_copy(struct ring r, int pos, jack_default_audio_sample_t *out,
+	       int n, float gain)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      jack_default_audio_sample_t *src = spans[s].buf;
+      for (int i = 0 ; i < spans[s].len ; i++) {
+	out[i] = src[i] * gain;
+      }
+      out += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* ring[pos, pos+n) = in[0, n) */
+void ring_write(struct ring r, int pos, jack_default_audio_sample_t *in, int n)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      memcpy(spans[s].buf, in, spans[s].len * sizeof(*in));
+      in += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* mix a playing track into the master.  If the track has its own
+   port it's written straight into that and summed from there. */
+void play_track(struct ring track, int pos, jack_default_audio_sample_t *out,
+		jack_default_audio_sample_t *track_out, int nframes, float gain)
+{
+  if (!track_out) {
+    ring_mix(track, pos, out, nframes, gain);
+    return;
+  }
+  ring_copy(track, pos, track_out, nframes, gain);
+  for (int i = 0 ; i < nframes ; i++) {
+    out[i] += track_out[i];
+  }
+}
+
+/* the ring holding the track for this musician's pedal */
+struct ring track_ring(struct musician *m, int pedal, int len)
+{
+  struct ring r = {m->track_bufs[pedal], len};
+  return r;
+}
+
+struct ring spare_ring(struct musician *m, int len)
+{
+  struct ring r = {m->spare, len};
+  return r;
+}
+
+struct ring history_ring(struct musician *m)
+{
+  struct ring r = {m->history, HISTORY_LEN};
+  return r;
+}
+
+/*** pad stuff ***/
+
+/* Besides the loops, a mouse given as pads=/dev/input/mouseN fires
+   one-shot samples (claps, hits, stings) from its three buttons.
+   Each pad plays PAD_FILE (pad0.raw, pad1.raw, pad2.raw: mono 32 bit
+   float at 48k, like looper_sync's replay output), read at startup
+   into locked memory.  A tap waits for the next PAD_QUANTUM point
+   while we have a tempo, and the sample starts on that exact frame.
+
+   Sounding samples are voices from a fixed pool.  How many we allow
+   is worked out at startup by timing a voice and seeing how many fit
+   in PAD_BUDGET_PERCENT of a cycle (never more than MAX_VOICES).
+   When they're all busy a new tap steals the one that started
+   longest ago. */
+#define N_PADS 3
+#define PAD_FILE "pad%d.raw"
+#define MAX_PAD_LEN (SAMPLE_RATE*4)
+#define PAD_LEVEL 1.0
+
+#define PAD_QUANTUM Q_NOW /* Q_BEAT to land taps on the next beat */
+
+#define MAX_VOICES 32
+#define PAD_BUDGET_PERCENT 10
+#define PAD_CALIBRATE_BLOCKS 200
+
+int pad_fd = -1;
+jack_port_t *pad_port; /* just the pads, with TRACK_PORTS */
+
+jack_default_audio_sample_t *pad_samples[N_PADS];
+int pad_len[N_PADS];
+
+struct voice {
+  int pad;          /* -1 when free */
+  int pos;          /* how far through the sample it is */
+  int start;        /* where in this block it starts */
+  long long serial; /* when it was started, for stealing */
+};
+
+struct voice voices[MAX_VOICES];
+int n_voices = MAX_VOICES; /* how many of them we'll use */
+long long voice_serial = 0;
+
+long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* read each pad's sample, if it has one */
+void pads_load()
+{
+  char name[32];
+
+  for (int pad = 0 ; pad < N_PADS ; pad++) {
+    pad_samples[pad] = alloc_audio_mem(MAX_PAD_LEN);
+    snprintf(name, sizeof(name), PAD_FILE, pad);
+
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+      printf("no %s, pad %d is silent\n", name, pad);
+      continue;
+    }
+    pad_len[pad] = fread(pad_samples[pad], sizeof(jack_default_audio_sample_t),
+			 MAX_PAD_LEN, f);
+    if (!feof(f)) { printf("%s is too long, only using %d seconds\n", name, MAX_PAD_LEN / SAMPLE_RATE); }
+    fclose(f);
+    printf("pad %d: %s, %.2fs\n", pad, name, (float) pad_len[pad] / SAMPLE_RATE);
+  }
+
+  for (int v = 0 ; v < MAX_VOICES ; v++) { voices[v].pad = -1; }
+}
+
+/* play as much of a voice as fits in out[v->start, nframes) */
+void voice_block(struct voice *v, jack_default_audio_sample_t *out, int nframes)
+{
+  jack_default_audio_sample_t *src = pad_samples[v->pad] + v->pos;
+  int n = pad_len[v->pad] - v->pos;
+  if (n > nframes - v->start) { n = nframes - v->start; }
+
+  for (int i = 0 ; i < n ; i++) {
+    out[v->start + i] += src[i] * PAD_LEVEL;
+  }
+  v->pos += n;
+  v->start = 0;
+  if (v->pos == pad_len[v->pad]) { v->pad = -1; }
+}
+
+/* time a voice over blocks of nframes and see how many fit in the
+   budget */
+void pads_calibrate(int nframes)
+{
+  jack_default_audio_sample_t *scratch = calloc(nframes, sizeof(*scratch));
+  struct voice v = {0, 0, 0, 0};
+  int loaded = pad_len[0];
+
+  pad_len[0] = MAX_PAD_LEN; /* whatever's in the buffer will do */
+  long long start = now_ns();
+  for (int b = 0 ; b < PAD_CALIBRATE_BLOCKS ; b++) {
+    v.pad = 0;
+    v.pos = (b * nframes) % (MAX_PAD_LEN - nframes);
+    voice_block(&v, scratch, nframes);
+  }
+  double voice_ns = (double)(now_ns() - start) / PAD_CALIBRATE_BLOCKS;
+  pad_len[0] = loaded;
+  free(scratch);
+
+  double budget_ns = 1e9 * nframes / SAMPLE_RATE * PAD_BUDGET_PERCENT / 100;
+  n_voices = budget_ns / voice_ns;
+  if (n_voices > MAX_VOICES) { n_voices = MAX_VOICES; }
+  if (n_voices < 1) { n_voices = 1; }
+  printf("pads: about %.0fns a voice per %d frame cycle, allowing %d voices\n",
+	 voice_ns, nframes, n_voices);
+}
+
+/* start pad sounding at offset into this block */
+void pad_start(int pad, int offset)
+{
+  if (pad_len[pad] == 0) { return; }
+
+  struct voice *v = &voices[0];
+  for (int i = 0 ; i < n_voices ; i++) {
+    if (voices[i].pad == -1) {
+      v = &voices[i];
+      break;
+    }
+    if (voices[i].serial < v->serial) { v = &voices[i]; }
+  }
+
+  v->pad = pad;
+  v->pos = 0;
+  v->start = offset;
+  v->serial = voice_serial++;
+}
+
+/* mix every sounding voice into out, and the pad port if there is one */
+void pads_block(jack_default_audio_sample_t *out, jack_default_audio_sample_t *pad_out,
+		int nframes)
+{
+  if (pad_out) { memset(pad_out, 0, nframes * sizeof(*pad_out)); }
+
+  for (int i = 0 ; i < n_voices ; i++) {
+    if (voices[i].pad == -1) { continue; }
+    voice_block(&voices[i], pad_out ? pad_out : out, nframes);
+  }
+
+  if (pad_out) {
+    for (int i = 0 ; i < nframes ; i++) { out[i] += pad_out[i]; }
+  }
+}
+
+/*** limiter stuff ***/
+
+/* Everything going to output passes through a lookahead limiter, so
+   we can leave the tracks at full volume and still not clip the PA.
+   We look LIMITER_LOOKAHEAD samples ahead: the output is delayed by
+   that much, and we tell jack so it can compensate.  Peaks are
+   estimated between samples too (true peak), by interpolating the
+   midpoint between each pair of samples.
+
+   For each sample we work out the gain it needs, hold the smallest
+   over a little more than the lookahead, and average that over a
+   little less.  That gets the gain all the way down by the time the
+   peak (and the samples either side of it) come out of the delay,
+   with a ramp instead of a step.  Gain comes back up with an
+   exponential release. */
+#define LIMITER_LOOKAHEAD 64
+#define HOLD_LEN (LIMITER_LOOKAHEAD + 1)
+#define BOX_LEN (LIMITER_LOOKAHEAD - 1)
+#define LIMITER_CEILING 0.89 /* -1dBFS */
+#define LIMITER_RELEASE_MS 100
+
+/* how often to say how hard the limiter has been working */
+#define LIMITER_REPORT_SECONDS 10
+
+/* we work through each cycle this many samples at a time */
+#define LIMITER_BLOCK 256
+
+jack_default_audio_sample_t limiter_delay_buf[LIMITER_LOOKAHEAD + LIMITER_BLOCK];
+int limiter_delay_pos = 0;
+
+/* the last three input samples, for the midpoint estimate */
+float limiter_x1, limiter_x2, limiter_x3;
+
+/* sliding minimum over the lookahead window, as a monotonic queue:
+   values increase from head to tail */
+float hold_vals[HOLD_LEN];
+long long hold_when[HOLD_LEN];
+int hold_head = 0, hold_len = 0;
+long long limiter_n = 0;
+
+/* running box average of the held gain */
+float box_vals[BOX_LEN];
+int box_pos = 0;
+double box_sum = 0;
+
+float limiter_gain = 1;
+
+/* start out at unity gain */
+void limiter_init()
+{
+  for (int i = 0 ; i < BOX_LEN ; i++) { box_vals[i] = 1; }
+  box_sum = BOX_LEN;
+}
+
+/* lowest gain since someone last looked, for telemetry */
+volatile float limiter_min_gain = 1;
+
+float limiter_need[LIMITER_BLOCK];
+float limiter_gains[LIMITER_BLOCK];
+jack_default_audio_sample_t limiter_delayed[LIMITER_BLOCK];
+
+void limit_block(jack_default_audio_sample_t *buf, int n)
+{
+  float release = 1 - expf(-1000.0 / (LIMITER_RELEASE_MS * SAMPLE_RATE));
+  struct ring delay = {limiter_delay_buf, LIMITER_LOOKAHEAD + LIMITER_BLOCK};
+
+  /* the gain each sample needs.  The midpoint between the two previous
+     samples is interpolated from the four around it, so we're one
+     sample behind on peaks; the lookahead covers that. */
+  float x1 = limiter_x1, x2 = limiter_x2, x3 = limiter_x3;
+  for (int i = 0 ; i < n ; i++) {
+    float x0 = buf[i];
+    float mid = (9 * (x1 + x2) - x0 - x3) / 16;
+    float peak = fmaxf(fabsf(x0), fabsf(mid));
+    limiter_need[i] = peak > LIMITER_CEILING ? LIMITER_CEILING / peak : 1;
+    x3 = x2; x2 = x1; x1 = x0;
+  }
+  limiter_x1 = x1; limiter_x2 = x2; limiter_x3 = x3;
+
+  /* hold the minimum, average it, release */
+  float gain = limiter_gain, lowest = limiter_min_gain;
+  for (int i = 0 ; i < n ; i++) {
+    long long now = limiter_n++;
+
+    while (hold_len > 0 &&
+	   hold_vals[(hold_head + hold_len - 1) % HOLD_LEN] >= limiter_need[i]) {
+      hold_len--;
+    }
+    if (hold_len > 0 && hold_when[hold_head] <= now - HOLD_LEN) {
+      hold_head = (hold_head + 1) % HOLD_LEN;
+      hold_len--;
+    }
+    int tail = (hold_head + hold_len++) % HOLD_LEN;
+    hold_vals[tail] = limiter_need[i];
+    hold_when[tail] = now;
+    float held = hold_vals[hold_head];
+
+    box_sum += held - box_vals[box_pos];
+    box_vals[box_pos] = held;
+    if (++box_pos == BOX_LEN) { box_pos = 0; }
+    float target = box_sum / BOX_LEN;
+
+    gain = target < gain ? target : gain + release * (target - gain);
+    limiter_gains[i] = gain;
+    if (gain < lowest) { lowest = gain; }
+  }
+  limiter_gain = gain;
+  limiter_min_gain = lowest;
+
+  /* delay the audio to line up with its gain, and apply it */
+  ring_write(delay, limiter_delay_pos, buf, n);
+  ring_read(delay, limiter_delay_pos - LIMITER_LOOKAHEAD, limiter_delayed, n);
+  limiter_delay_pos = (limiter_delay_pos + n) % delay.len;
+  for (int i = 0 ; i < n ; i++) {
+    buf[i] = limiter_delayed[i] * limiter_gains[i];
+  }
+}
+
+void limit(jack_default_audio_sample_t *buf, int nframes)
+{
+  for (int base = 0 ; base < nframes ; base += LIMITER_BLOCK) {
+    limit_block(buf + base, nframes - base < LIMITER_BLOCK ? nframes - base : LIMITER_BLOCK);
+  }
+}
+
+/* the limiter delays output, so tell jack about it.  With several
+   inputs the output's capture latency covers all of them. */
+void latency_callback(jack_latency_callback_mode_t mode, void *arg)
+{
+  jack_latency_range_t range, in_range;
+
+  if (mode == JackCaptureLatency) {
+    jack_port_get_latency_range (musicians[0].input_port, mode, &range);
+    for (int who = 1 ; who < n_musicians ; who++) {
+      jack_port_get_latency_range (musicians[who].input_port, mode, &in_range);
+      if (in_range.min < range.min) { range.min = in_range.min; }
+      if (in_range.max > range.max) { range.max = in_range.max; }
+    }
+    range.min += LIMITER_LOOKAHEAD;
+    range.max += LIMITER_LOOKAHEAD;
+    jack_port_set_latency_range (output_port, mode, &range);
+  }
+  else {
+    jack_port_get_latency_range (output_port, mode, &range);
+    range.min += LIMITER_LOOKAHEAD;
+    range.max += LIMITER_LOOKAHEAD;
+    for (int who = 0 ; who < n_musicians ; who++) {
+      jack_port_set_latency_range (musicians[who].input_port, mode, &range);
+    }
+  }
+}
+
+/* how much the limiter has turned things down since we last asked */
+void print_limiter()
+{
+  float lowest = limiter_min_gain;
+  limiter_min_gain = 1;
+  if (lowest < 1) {
+    printf("limiter: %.1f dB gain reduction\n", -20 * log10f(lowest));
+  }
+}
 
-void beep(){
-  char beeparr[] = {7, '\0'};
-  printf("%s", beeparr);
+/* a pedal was pressed late samples after the point it was waiting
+   for: copy what we heard since then out of the history into track,
+   as if we'd been recording all along. */
+void record_from_history(struct musician *m, struct ring track, int late)
+{
+  struct span spans[2];
+  int n_spans = ring_spans(history_ring(m), m->history_pos - late, late, spans);
+  int dst = loop_pos - late;
+
+  for (int s = 0 ; s < n_spans ; s++) {
+    ring_write(track, dst, spans[s].buf, spans[s].len);
+    dst += spans[s].len;
+  }
 }
 
-/* figure out which button is active, if any.  Returns one of MOUSE_A, MOUSE_4, MOUSE_3, or MOUSE_None */
-int get_mouse()
+/* figure out which button on this mouse is active, if any.  Returns one of MOUSE_A, MOUSE_4, MOUSE_3, or MOUSE_None */
+int get_mouse(int fd)
 {
-  if ((amt_read_mouse = read(mouse_fd, mouse_buf, MAX_MOUSE_READ)) == -1){
+  if ((amt_read_mouse = read(fd, mouse_buf, MAX_MOUSE_READ)) == -1){
     if (errno != EINTR && errno != EAGAIN) {
       perror("badness");
       exit(-1);
@@ -150,23 +1146,454 @@ int get_mouse()
   return MOUSE_None;
 }
 
+void respond_to_cue(int cue)
+{
+  if (cue == CUE_None) { return; }
+  if (state != S_RUN) {
+    printf("no tune to jump around in yet\n");
+    return;
+  }
+  if (cue == CUE_CANCEL) {
+    if (cued_part != CUE_None) { printf("jump cancelled\n"); }
+    cued_part = CUE_None;
+    return;
+  }
+
+  printf("will jump to %s\n", part_names[cue]);
+  cued_part = cue;
+  if (!jump_pending) {
+    schedule(tune_frame + until_quantum(JUMP_QUANTUM, loop_pos), ACT_JUMP,
+	     &musicians[0], 0);
+    jump_pending = 1;
+  }
+}
+
+/* Replacing a playing track without it dropping out: type r and the
+   pedal on the terminal (r2, or r1.2 for musician 1's pedal 2).  The
+   old take keeps playing while the new one records into the
+   musician's spare buffer, starting at the next REC_QUANTUM point (or
+   from the history, if that was less than LATE_WINDOW ago) and going
+   once through the tune like any other take.  Then, on the exact
+   frame it finishes, the spare and the track's buffer trade places
+   and the old take becomes the spare.  Typing it again during a
+   repeat records through the repeats, like tapping a recording pedal.
+   Turning the pedal off abandons the replacement.  Each musician can
+   replace one track at a time. */
+
+/* the replacement starts recording at frame */
+void shadow_start(struct musician *m, int pedal, long long frame)
+{
+  m->spare_split = take_split(frame);
+  m->replace_rec = 1;
+  schedule(frame + loop_end, ACT_SWAP, m, pedal);
+}
+
+void respond_to_replace(int who, int pedal)
+{
+  if (state != S_RUN || who >= n_musicians || pedal > 2) {
+    printf("no track %d.%d to replace\n", who, pedal);
+    return;
+  }
+
+  struct musician *m = &musicians[who];
+  if (m->pedal_states[pedal] != pS_PLY) {
+    printf("%d.%d isn't playing, so there's nothing to replace\n", who, pedal);
+    return;
+  }
+
+  if (m->replacing == pedal && m->replace_rec &&
+      split_pos(m->spare_split, loop_pos) != loop_pos) {
+    /* this repeat is different: record from the top of it on */
+    int late = since_quantum(Q_PART, loop_pos);
+    if (late >= LATE_WINDOW) { late = 0; }
+    m->spare_split = loop_pos - late;
+    printf("replacing %d.%d through the repeats (%d late)\n", who, pedal, late);
+    if (late) { record_from_history(m, spare_ring(m, loop_end), late); }
+    return;
+  }
+  if (m->replacing != -1) {
+    printf("already replacing %d.%d\n", who, m->replacing);
+    return;
+  }
+
+  m->replacing = pedal;
+  int late = since_quantum(REC_QUANTUM, loop_pos);
+  if (late > 0 && late < LATE_WINDOW) {
+    printf("late start replacing %d.%d (%d late)\n", who, pedal, late);
+    shadow_start(m, pedal, tune_frame - late);
+    record_from_history(m, spare_ring(m, loop_end), late);
+    return;
+  }
+  printf("waiting to replace %d.%d\n", who, pedal);
+  m->replace_rec = 0;
+  schedule(tune_frame + until_quantum(REC_QUANTUM, loop_pos), ACT_SHADOW,
+	   m, pedal);
+}
+
+/* Typing is read by a thread of its own, never by process(): reading
+   the terminal while we're in the background would stop us with
+   SIGTTIN, and making it nonblocking would change it for the shell
+   too, which shares it.  We only read while we're the terminal's
+   foreground process.  What's typed goes on to process() through a
+   queue that only the terminal thread writes and only process()
+   reads, so neither ever waits for the other. */
+#define MAX_TERMINAL_READ 64
+#define TYPED_QUEUE_LEN 16 /* a power of two */
+
+#define TYPED_CUE     0 /* a is the cue */
+#define TYPED_REPLACE 1 /* a is the musician, b the pedal */
+
+struct typed {
+  int what, a, b;
+};
+
+struct typed typed_queue[TYPED_QUEUE_LEN];
+volatile unsigned typed_head = 0; /* written by the terminal thread */
+volatile unsigned typed_tail = 0; /* written by process() */
+
+/* terminal thread: if the queue's full, it gets dropped */
+void push_typed(int what, int a, int b)
+{
+  if (typed_head - typed_tail == TYPED_QUEUE_LEN) { return; }
+  struct typed *t = &typed_queue[typed_head % TYPED_QUEUE_LEN];
+  t->what = what;
+  t->a = a;
+  t->b = b;
+  __sync_synchronize();
+  typed_head++;
+}
+
+/* process(): act on everything typed since last cycle */
+void take_typed()
+{
+  while (typed_tail != typed_head) {
+    __sync_synchronize();
+    struct typed t = typed_queue[typed_tail % TYPED_QUEUE_LEN];
+    __sync_synchronize();
+    typed_tail++;
+
+    if (t.what == TYPED_CUE) { respond_to_cue(t.a); }
+    else { respond_to_replace(t.a, t.b); }
+  }
+}
+
+/* a part to jump to, x to cancel a jump, or r and a pedal to replace */
+void parse_typed(char *buf, int n)
+{
+  for (int i = 0 ; i < n ; i++) {
+    char c = tolower(buf[i]);
+    char next = i + 1 < n ? buf[i + 1] : 0;
+
+    if (c == 'x') { push_typed(TYPED_CUE, CUE_CANCEL, 0); }
+    else if ((c == 'a' || c == 'b') && (next == '1' || next == '2')) {
+      push_typed(TYPED_CUE, (c == 'b' ? 2 : 0) + next - '1', 0);
+    }
+    else if (c == 'r' && isdigit(next)) {
+      if (i + 3 < n && buf[i + 2] == '.' && isdigit(buf[i + 3])) {
+	push_typed(TYPED_REPLACE, next - '0', buf[i + 3] - '0');
+      }
+      else {
+	push_typed(TYPED_REPLACE, 0, next - '0');
+      }
+    }
+  }
+}
+
+int in_foreground()
+{
+  return tcgetpgrp(0) == getpgrp();
+}
+
+void *terminal_reader(void *arg)
+{
+  char buf[MAX_TERMINAL_READ];
+  struct pollfd pfd = {0, POLLIN, 0};
+
+  while (1) {
+    if (!in_foreground()) {
+      sleep(1);
+      continue;
+    }
+    /* time out now and then to see if we've been put in the background */
+    if (poll(&pfd, 1, 1000) <= 0) { continue; }
+    if (!in_foreground()) { continue; }
+
+    int n = read(0, buf, sizeof(buf));
+    if (n > 0) { parse_typed(buf, n); }
+    else if (pfd.revents & POLLHUP) { return NULL; } /* terminal's gone */
+    else if (n < 0) { sleep(1); }
+  }
+  return NULL;
+}
+
+void start_terminal()
+{
+  pthread_t thread;
+
+  if (!isatty(0)) {
+    printf("not reading cues: stdin isn't a terminal\n");
+    return;
+  }
+  /* if we get put in the background just as we read, fail the read
+     rather than stop */
+  signal(SIGTTIN, SIG_IGN);
+  if (pthread_create(&thread, NULL, terminal_reader, NULL)) {
+    fprintf(stderr, "cannot start terminal thread\n");
+    exit(1);
+  }
+}
+
 /* if all our pedals are off, then we're off globally too */        
 void check_all_off()
 {
-  if (pedal_states[0] + pedal_states[1] + pedal_states[2] == pS_OFF) {
-    state = S_OFF;
+  for (int who = 0 ; who < n_musicians ; who++) {
+    int *pedal_states = musicians[who].pedal_states;
+    if (pedal_states[0] + pedal_states[1] + pedal_states[2] != pS_OFF) { return; }
+  }
+  state = S_OFF;
+}
+
+/* whether any track is playing (rather than recording or off) */
+int any_playing()
+{
+  for (int who = 0 ; who < n_musicians ; who++) {
+    for (int pedal = 0 ; pedal < 3 ; pedal++) {
+      if (musicians[who].pedal_states[pedal] == pS_PLY) { return 1; }
+    }
+  }
+  return 0;
+}
+
+/* what a track sounds like over [pos, pos+n) of the tune, into buf.
+   Where it's recording that's silence. */
+void track_sound(struct musician *m, int pedal, int pos,
+		 jack_default_audio_sample_t *buf, int n)
+{
+  for (int done = 0 ; done < n ; ) {
+    int p = (pos + done) % loop_end;
+    int len = part_run(m, pedal, p, n - done);
+    int from = track_pos(m, pedal, p);
+
+    if (m->pedal_states[pedal] == pS_REC && from == p) {
+      memset(buf + done, 0, len * sizeof(*buf));
+    }
+    else {
+      ring_copy(track_ring(m, pedal, loop_end), from, buf + done, len,
+		1.0 / VOLUME_DECREASE);
+    }
+    done += len;
+  }
+}
+
+jack_default_audio_sample_t xfade_new[XFADE_LEN];
+jack_default_audio_sample_t xfade_old[XFADE_LEN];
+
+/* after a jump the tracks have just been played from where they are
+   now; over the first XFADE_LEN samples fade that in from where they
+   would have been.  f is no more than what's left of the fade. */
+void fade_tracks(struct musician *m, jack_default_audio_sample_t *out,
+		 int offset, int f)
+{
+  int pos = (loop_pos + offset) % loop_end;
+
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    if (m->pedal_states[pedal] != pS_PLY && m->pedal_states[pedal] != pS_REC) { continue; }
+
+    track_sound(m, pedal, pos, xfade_new, f);
+    track_sound(m, pedal, (pos + xfade_shift) % loop_end, xfade_old, f);
+    for (int i = 0 ; i < f ; i++) {
+      float d = (xfade_old[i] - xfade_new[i]) *
+	(1 - (float) (xfade_done + i) / XFADE_LEN);
+      out[offset + i] += d;
+      if (m->track_out[pedal]) { m->track_out[pedal][offset + i] += d; }
+    }
   }
 }
 
-void respond_to_mouse(int mouse_press, int nframes) {
+/* everything one musician's tracks do for samples [offset, offset+n)
+   of this block.  Ports for tracks that aren't playing get silence.
+   A recording track plays the repeats it isn't recording. */
+void run_tracks(struct musician *m, jack_default_audio_sample_t *out,
+		int offset, int n)
+{
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    jack_default_audio_sample_t *port = m->track_out[pedal] ? m->track_out[pedal] + offset : NULL;
+
+    if (m->pedal_states[pedal] == pS_PLY || m->pedal_states[pedal] == pS_REC) {
+      for (int done = 0 ; done < n ; ) {
+	int pos = (loop_pos + offset + done) % loop_end;
+	int len = part_run(m, pedal, pos, n - done);
+	int from = track_pos(m, pedal, pos);
+
+	if (m->pedal_states[pedal] == pS_REC && from == pos) {
+	  ring_write(track_ring(m, pedal, loop_end), pos, m->in + offset + done, len);
+	  if (port) { memset(port + done, 0, len * sizeof(*port)); }
+	}
+	else {
+	  play_track(track_ring(m, pedal, loop_end), from, out + offset + done,
+		     port ? port + done : NULL, len, 1.0 / VOLUME_DECREASE);
+	}
+	done += len;
+      }
+    }
+    else if (port) {
+      memset(port, 0, n * sizeof(*port));
+    }
+    m->played[pedal] = offset + n;
+
+    /* a replacement records its parts into the spare while the old
+       take plays */
+    if (m->replacing == pedal && m->replace_rec) {
+      for (int done = 0 ; done < n ; ) {
+	int pos = (loop_pos + offset + done) % loop_end;
+	int len = split_run(m->spare_split, pos, n - done);
+
+	if (split_pos(m->spare_split, pos) == pos) {
+	  ring_write(spare_ring(m, loop_end), pos, m->in + offset + done, len);
+	}
+	done += len;
+      }
+    }
+  }
+}
+
+/* everyone's tracks, for samples [offset, offset+n) of this block */
+void run_all(jack_default_audio_sample_t *out, int offset, int n)
+{
+  for (int who = 0 ; who < n_musicians ; who++) {
+    run_tracks(&musicians[who], out, offset, n);
+  }
+
+  if (xfade_done < XFADE_LEN) {
+    int f = XFADE_LEN - xfade_done;
+    if (f > n) { f = n; }
+    for (int who = 0 ; who < n_musicians ; who++) {
+      fade_tracks(&musicians[who], out, offset, f);
+    }
+    xfade_done += f;
+  }
+}
+
+/* the cued jump has come due at frame: from here on loop_pos + at,
+   where we'd have been, becomes the top of the cued part */
+void jump(long long frame)
+{
+  jump_pending = 0;
+  if (cued_part == CUE_None) { return; } /* cancelled */
+
+  int at = frame > tune_frame ? frame - tune_frame : 0;
+  int from = (loop_pos + at) % loop_end;
+  int to = part_start[cued_part];
+  int delta = (to - from + loop_end) % loop_end;
+  if (delta > loop_end / 2) { delta -= loop_end; } /* a repeat */
+
+  if (delta == 0) {
+    printf("already going to %s\n", part_names[cued_part]);
+  }
+  else {
+    printf("jumping to %s instead of %s\n", part_names[cued_part],
+	   part_names[part_of(from)]);
+    loop_pos = to - at;
+    if (loop_pos < 0) { loop_pos += loop_end; }
+    tune_frame += delta;
+    xfade_shift = (loop_end - delta) % loop_end;
+    xfade_done = 0;
+  }
+  cued_part = CUE_None;
+}
+
+/* an action has come due */
+void do_action(struct action *a)
+{
+  if (a->what == ACT_JUMP) {
+    jump(a->frame);
+    return;
+  }
+  if (a->what == ACT_PAD) {
+    pad_start(a->pedal, a->frame > tune_frame ? a->frame - tune_frame : 0);
+    return;
+  }
+
+  struct musician *m = &musicians[a->who];
+  if (a->gen != m->pedal_gen[a->pedal]) { return; } /* pedal's been turned off since */
+
+  switch (a->what) {
+  case ACT_REC:
+    if (m->pedal_states[a->pedal] == pS_WREC) {
+      take_start(m, a->pedal, a->frame);
+      printf ("recording secondary %d.%d (%s)\n", m->id, a->pedal,
+	      m->track_split[a->pedal] ? "sections" : "whole tune");
+      m->pedal_states[a->pedal] = pS_REC;
+      schedule(a->frame + loop_end, ACT_PLY, m, a->pedal);
+    }
+    break;
+  case ACT_PLY:
+    if (m->pedal_states[a->pedal] == pS_REC) {
+      printf ("playing secondary %d.%d\n", m->id, a->pedal);
+      m->pedal_states[a->pedal] = pS_PLY;
+    }
+    break;
+  case ACT_SHADOW:
+    if (m->replacing == a->pedal && !m->replace_rec) {
+      shadow_start(m, a->pedal, a->frame);
+      printf ("replacing %d.%d (%s)\n", m->id, a->pedal,
+	      m->spare_split ? "sections" : "whole tune");
+    }
+    break;
+  case ACT_SWAP:
+    if (m->replacing == a->pedal && m->replace_rec) {
+      jack_default_audio_sample_t *old = m->track_bufs[a->pedal];
+      m->track_bufs[a->pedal] = m->spare;
+      m->spare = old;
+      m->track_split[a->pedal] = m->spare_split;
+      m->replacing = -1;
+      printf ("replaced %d.%d\n", m->id, a->pedal);
+    }
+    break;
+  case ACT_OFF:
+    printf("pedal off %d.%d\n", m->id, a->pedal);
+    if (m->replacing == a->pedal) { m->replacing = -1; }
+    m->pedal_states[a->pedal] = pS_OFF;
+    m->pedal_gen[a->pedal]++;
+    unschedule_pedal(m, a->pedal);
+    check_all_off();
+    break;
+  }
+}
+
+/* a pad tap fires now, or at the next PAD_QUANTUM point once there's
+   a tempo */
+void respond_to_pads(int pad)
+{
+  if (pad == MOUSE_None) { return; }
+
+  if (state != S_RUN || PAD_QUANTUM == Q_NOW) {
+    pad_start(pad, 0);
+    return;
+  }
+  if (!scheduled(ACT_PAD, &musicians[0], pad)) {
+    schedule(tune_frame + until_quantum(PAD_QUANTUM, loop_pos), ACT_PAD,
+	     &musicians[0], pad);
+  }
+}
+
+void respond_to_mouse(struct musician *m, int mouse_press, int nframes) {
   if (mouse_press == MOUSE_None) { return; }
 
+  /* two musicians can both tap a potato in one cycle.  Only the first
+     counts: the second would make a gap of no time at all, and a tune
+     of no length. */
+  if (state >= S_P1 && state <= S_P4 && potato_time == 0) { return; }
+
   switch(state) {
   case S_OFF:
     printf("(potato 1)\n");
-    pedal_states[0] = pS_OFF;
-    pedal_states[1] = pS_OFF;
-    pedal_states[2] = pS_OFF;
+    for (int who = 0 ; who < n_musicians ; who++) {
+      for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	musicians[who].pedal_states[pedal] = pS_OFF;
+      }
+      musicians[who].replacing = -1;
+    }
     potato_time = 0;
     state = S_P1;
     break;
@@ -209,22 +1636,53 @@ void respond_to_mouse(int mouse_press, int nframes) {
 
     printf("bpm: %d\n", BPM(loop_end));
 
+    index_tune();
+
     state = S_RUN;
-    pedal_states[mouse_press] = pS_WREC;
+    tune_frame = 0;
+    n_actions = 0;
+    cued_part = CUE_None;
+    jump_pending = 0;
+    xfade_done = XFADE_LEN;
+    m->pedal_states[mouse_press] = pS_WREC;
+    schedule(tune_frame, ACT_REC, m, mouse_press);
 
     break;
   case S_RUN:
-    switch(pedal_states[mouse_press]){
-    case pS_OFF:
-      printf("waiting to record %d\n", mouse_press);
-      pedal_states[mouse_press] = pS_WREC;
+    switch(m->pedal_states[mouse_press]){
+    case pS_OFF: {
+      int late = since_quantum(REC_QUANTUM, loop_pos);
+      if (late > 0 && late < LATE_WINDOW) {
+	printf("late start recording %d.%d (%d late)\n", m->id, mouse_press, late);
+	take_start(m, mouse_press, tune_frame - late);
+	record_from_history(m, track_ring(m, mouse_press, loop_end), late);
+	m->pedal_states[mouse_press] = pS_REC;
+	schedule(tune_frame - late + loop_end, ACT_PLY, m, mouse_press);
+	break;
+      }
+      printf("waiting to record %d.%d\n", m->id, mouse_press);
+      m->pedal_states[mouse_press] = pS_WREC;
+      schedule(tune_frame + until_quantum(REC_QUANTUM, loop_pos),
+	       ACT_REC, m, mouse_press);
       break;
-    case pS_WREC:
+    }
     case pS_REC:
+      if (track_pos(m, mouse_press, loop_pos) != loop_pos) {
+	/* this repeat is different: record from the top of it on */
+	int late = since_quantum(Q_PART, loop_pos);
+	if (late >= LATE_WINDOW) { late = 0; }
+	m->track_split[mouse_press] = loop_pos - late;
+	printf("recording %d.%d through the repeats (%d late)\n", m->id, mouse_press, late);
+	if (late) { record_from_history(m, track_ring(m, mouse_press, loop_end), late); }
+	break;
+      }
+      /* fall through */
+    case pS_WREC:
     case pS_PLY:
-      printf("pedal off %d\n", mouse_press);
-      pedal_states[mouse_press] = pS_OFF;
-      check_all_off();      
+      if (!scheduled(ACT_OFF, m, mouse_press)) {
+	schedule(tune_frame + until_quantum(OFF_QUANTUM, loop_pos),
+		 ACT_OFF, m, mouse_press);
+      }
       break;
     }
   }
@@ -240,18 +1698,51 @@ void respond_to_mouse(int mouse_press, int nframes) {
  */
 int process (jack_nframes_t nframes, void *arg)
 {
-        jack_default_audio_sample_t *in, *out;
-	in = jack_port_get_buffer (input_port, nframes);
+        jack_default_audio_sample_t *out, *click_out;
 	out = jack_port_get_buffer (output_port, nframes);
+	click_out = jack_port_get_buffer (click_port, nframes);
 
 	/* move between states apropriately */
-	respond_to_mouse(get_mouse(), nframes);
+	for (int who = 0 ; who < n_musicians ; who++) {
+	  respond_to_mouse(&musicians[who], get_mouse(musicians[who].mouse_fd), nframes);
+	}
+	take_typed();
+	if (pad_fd != -1) { respond_to_pads(get_mouse(pad_fd)); }
 
-	
-	for (int i = 0 ; i < nframes ; i++) {
-	  out[i] = in[i] / VOLUME_DECREASE;
+	memset (out, 0, nframes * sizeof(*out));
+	for (int who = 0 ; who < n_musicians ; who++) {
+	  struct musician *m = &musicians[who];
+	  m->in = jack_port_get_buffer (m->input_port, nframes);
+
+	  for (int i = 0 ; i < nframes ; i++) {
+	    out[i] += m->in[i] / VOLUME_DECREASE;
+	  }
+
+	  /* the per track ports.  Whatever doesn't get played into this
+	     cycle is cleared at the end. */
+	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	    m->track_out[pedal] = NULL;
+	    m->played[pedal] = 0;
+	  }
+	  if (TRACK_PORTS) {
+	    for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	      m->track_out[pedal] = jack_port_get_buffer (m->track_ports[pedal], nframes);
+	    }
+	    memcpy (jack_port_get_buffer (m->dry_port, nframes), m->in,
+		    nframes * sizeof(jack_default_audio_sample_t));
+	  }
+
+	  /* always keep the input history, whatever state we're in */
+	  ring_write(history_ring(m), m->history_pos, m->in, nframes);
+	  m->history_pos = (m->history_pos + nframes) % HISTORY_LEN;
 	}
 	
+	/* the metronome, while we have a tempo.  With CLICK_ALWAYS off we
+	   only click while just one track is recording and the rest are
+	   off. */
+	click_block(click_out, nframes,
+		    state == S_RUN && (CLICK_ALWAYS || !any_playing()));
+
 	switch (state) {
 	case S_OFF:
 	  break;
@@ -269,12 +1760,6 @@ int process (jack_nframes_t nframes, void *arg)
 
 	  /* print loop location */
 	  if (loop_pos % (loop_end / 64) == 0) {
-	    if (pedal_states[0] != pS_PLY &&
-		pedal_states[1] != pS_PLY &&
-		pedal_states[2] != pS_PLY){
-	      /* only one is recording and the rest are off */
-	      beep();
-	    }
 	    switch (loop_pos / (loop_end / 64)) {
 	    case 0:
 	      printf("A1......");
@@ -303,37 +1788,45 @@ int process (jack_nframes_t nframes, void *arg)
 	    printf("              %d\n", (loop_pos / (loop_end / 64)));
 	  }
 
-	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
-
-	    if (loop_pos == 0) {
-	      if (pedal_states[pedal] == pS_WREC) {
-		printf ("recording secondary %d\n", pedal);
-		pedal_states[pedal] = pS_REC;
-	      }
-	      else if (pedal_states[pedal] == pS_REC) {
-		printf ("playing secondary %d\n", pedal);
-                pedal_states[pedal] = pS_PLY;
-              }
-	    }
-
-	    if (pedal_states[pedal] == pS_PLY) {
-	      for (int i = 0 ; i < nframes ; i++) {
-		out[i] += loop_bufs[AMT_MEM*pedal + loop_pos + i] / VOLUME_DECREASE;
-	      }
-	    }
-	    else if (pedal_states[pedal] == pS_REC) {
-	      for (int i = 0 ; i < nframes ; i++) {
-		loop_bufs[AMT_MEM*pedal + loop_pos + i] = in[i];
-	      }
+	  /* run the tracks up to each action that's due in this block,
+	     then do the action, then carry on */
+	  int done = 0;
+	  while (n_actions > 0 && actions[0].frame < tune_frame + nframes) {
+	    struct action a = unschedule();
+	    int at = a.frame > tune_frame ? a.frame - tune_frame : 0;
+	    if (at > done) {
+	      run_all(out, done, at - done);
+	      done = at;
 	    }
-
+	    do_action(&a);
+	    if (state != S_RUN) { break; }
+	  }
+	  if (state == S_RUN && done < nframes) {
+	    run_all(out, done, nframes - done);
 	  }
 
 	  loop_pos += nframes;
+	  tune_frame += nframes;
 	  break;
 	}
 	
-	if (state == S_RUN && loop_pos >= loop_end) { loop_pos = 0 ;}
+	pads_block(out, pad_port ? jack_port_get_buffer (pad_port, nframes) : NULL,
+		   nframes);
+
+	limit(out, nframes);
+
+	for (int who = 0 ; who < n_musicians ; who++) {
+	  struct musician *m = &musicians[who];
+	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	    /* stopping mid-block leaves the rest of the block unwritten */
+	    if (m->track_out[pedal] && m->played[pedal] < nframes) {
+	      memset (m->track_out[pedal] + m->played[pedal], 0,
+		      (nframes - m->played[pedal]) * sizeof(jack_default_audio_sample_t));
+	    }
+	  }
+	}
+
+	if (state == S_RUN && loop_pos >= loop_end) { loop_pos -= loop_end ;}
 	if (loop_pos >= AMT_MEM) {
 	  printf("ERROR: loop_pos >= AMT_MEM %d %d\n", loop_pos, AMT_MEM);
 	  loop_pos = 0;
@@ -342,6 +1835,23 @@ int process (jack_nframes_t nframes, void *arg)
 	return 0;
 }
 
+/* register one of a musician's ports, or give up */
+jack_port_t *musician_port(struct musician *m, const char *name, unsigned long flags)
+{
+  char full[32];
+  jack_port_t *port;
+
+  if (m->id == 0) { snprintf (full, sizeof(full), "%s", name); }
+  else { snprintf (full, sizeof(full), "%s_%d", name, m->id); }
+
+  port = jack_port_register (client, full, JACK_DEFAULT_AUDIO_TYPE, flags, 0);
+  if (port == NULL) {
+    fprintf(stderr, "no more JACK ports available\n");
+    exit (1);
+  }
+  return port;
+}
+
 /**
  * JACK calls this shutdown_callback if the server ever shuts down or
  * decides to disconnect the client.
@@ -353,9 +1863,17 @@ void jack_shutdown (void *arg)
 
 int main (int argc, char *argv[])
 {
-        if (argc != 2) {
-	  printf("Usage: %s mouse_dev_fname\n", argv[0]);
+        const char *mice[MAX_MUSICIANS + 1];
+        const char *pad_mouse = NULL;
+
+        for (int i = 1 ; i < argc ; i++) {
+	  if (strncmp(argv[i], "pads=", 5) == 0) { pad_mouse = argv[i] + 5; }
+	  else if (n_musicians <= MAX_MUSICIANS) { mice[n_musicians++] = argv[i]; }
+        }
+        if (n_musicians < 1 || n_musicians > MAX_MUSICIANS) {
+	  printf("Usage: %s mouse_dev_fname [mouse_dev_fname ...] [pads=mouse_dev_fname]\n", argv[0]);
 	  printf("Example: %s /dev/input/mouse2\n", argv[0]);
+	  printf("One mouse per musician, up to %d\n", MAX_MUSICIANS);
 	  exit(1);
         }
 	
@@ -366,11 +1884,38 @@ int main (int argc, char *argv[])
 	jack_options_t options = JackNullOption;
 	jack_status_t status;
 
-	/* open the mouse nonblocking.  We'll poll it each time we process a frame */
-	if ((mouse_fd = open(argv[1], O_RDONLY | O_NONBLOCK)) == -1){
-	  fprintf (stderr, "open mouse %s failed\n", argv[1]);
+	/* get all our audio memory in place before we go realtime */
+	print_faults("at startup");
+	lock_memory();
+	for (int who = 0 ; who < n_musicians ; who++) {
+	  musicians[who].id = who;
+	  jack_default_audio_sample_t *bufs = alloc_audio_mem(AMT_MEM*4);
+	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	    musicians[who].track_bufs[pedal] = bufs + AMT_MEM*pedal;
+	  }
+	  musicians[who].spare = bufs + AMT_MEM*3;
+	  musicians[who].replacing = -1;
+	  musicians[who].history = alloc_audio_mem(HISTORY_LEN);
+	}
+	if (pad_mouse) { pads_load(); }
+	limiter_init();
+	make_click(click_wave, CLICK_FREQ, CLICK_LEVEL);
+	make_click(accent_wave, ACCENT_FREQ, ACCENT_LEVEL);
+
+	/* open the mice nonblocking.  We'll poll them each time we process a frame */
+	for (int who = 0 ; who < n_musicians ; who++) {
+	  if ((musicians[who].mouse_fd = open(mice[who], O_RDONLY | O_NONBLOCK)) == -1){
+	    fprintf (stderr, "open mouse %s failed\n", mice[who]);
+	    exit(1);
+	  }
+	}
+	if (pad_mouse && (pad_fd = open(pad_mouse, O_RDONLY | O_NONBLOCK)) == -1) {
+	  fprintf (stderr, "open pad mouse %s failed\n", pad_mouse);
 	  exit(1);
 	}
+
+	/* and the terminal, for cueing jumps */
+	start_terminal();
 	  
 
 	/* open a client connection to the JACK server */
@@ -389,8 +1934,12 @@ int main (int argc, char *argv[])
 	/* tell the JACK server to call `process()' whenever
 	   there is work to be done.
 	*/
+	jack_set_thread_init_callback (client, thread_init, 0);
 	jack_set_process_callback (client, process, 0);
 
+	/* and `latency_callback()' so we can tell it about the limiter */
+	jack_set_latency_callback (client, latency_callback, 0);
+
 	/* tell the JACK server to call `jack_shutdown()' if
 	   it ever shuts down, either entirely, or if it
 	   just decides to stop calling us.
@@ -407,18 +1956,49 @@ int main (int argc, char *argv[])
 	  
 
 	/* create input and output ports */
-	input_port = jack_port_register (client, "input",
-					 JACK_DEFAULT_AUDIO_TYPE,
-					 JackPortIsInput, 0);
 	output_port = jack_port_register (client, "output",
 					  JACK_DEFAULT_AUDIO_TYPE,
 					  JackPortIsOutput, 0);
+	click_port = jack_port_register (client, "click",
+					 JACK_DEFAULT_AUDIO_TYPE,
+					 JackPortIsOutput, 0);
 
-	if ((input_port == NULL) || (output_port == NULL)) {
+	if ((output_port == NULL) || (click_port == NULL)) {
 		fprintf(stderr, "no more JACK ports available\n");
 		exit (1);
 	}
 
+	/* and each musician's.  The first musician's are input, track0,
+	   and so on, the second's input_1, track0_1, ... */
+	for (int who = 0 ; who < n_musicians ; who++) {
+	  struct musician *m = &musicians[who];
+
+	  m->input_port = musician_port (m, "input", JackPortIsInput);
+	  if (TRACK_PORTS) {
+	    char name[32];
+	    for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	      snprintf (name, sizeof(name), "track%d", pedal);
+	      m->track_ports[pedal] = musician_port (m, name, JackPortIsOutput);
+	    }
+	    m->dry_port = musician_port (m, "dry", JackPortIsOutput);
+	  }
+	}
+
+	if (pad_mouse) {
+	  pads_calibrate (jack_get_buffer_size (client));
+	  if (TRACK_PORTS) {
+	    pad_port = jack_port_register (client, "pads",
+					   JACK_DEFAULT_AUDIO_TYPE,
+					   JackPortIsOutput, 0);
+	    if (pad_port == NULL) {
+	      fprintf(stderr, "no more JACK ports available\n");
+	      exit (1);
+	    }
+	  }
+	}
+
+	print_faults("before activation");
+
 	/* Tell the JACK server that we are ready to roll.  Our
 	 * process() callback will start running now. */
 	if (jack_activate (client)) {
@@ -440,8 +2020,13 @@ int main (int argc, char *argv[])
 		exit (1);
 	}
 
-	if (jack_connect (client, ports[0], jack_port_name (input_port))) {
+	/* each musician gets their own capture port if there are enough */
+	for (int who = 0 ; who < n_musicians ; who++) {
+	  const char *capture = ports[0];
+	  for (int i = 0 ; i <= who && ports[i] ; i++) { capture = ports[i]; }
+	  if (jack_connect (client, capture, jack_port_name (musicians[who].input_port))) {
 		fprintf (stderr, "cannot connect input ports\n");
+	  }
 	}
 
 	free (ports);
@@ -459,9 +2044,15 @@ int main (int argc, char *argv[])
 
 	free (ports);
 
-	/* keep running until stopped by the user */
+	print_faults("after activation");
+
+	/* keep running until stopped by the user, letting them know
+	   when the limiter's been working */
 
-	sleep (-1);
+	while (1) {
+	  sleep (LIMITER_REPORT_SECONDS);
+	  print_limiter();
+	}
 
 	/* this is never reached but if the program
 	   had some other way to exit besides being killed,
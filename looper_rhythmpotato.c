@@ -6,6 +6,8 @@
  * indicators of where we are in the tune.
  */
 
+#define _GNU_SOURCE /* for MAP_HUGETLB and friends */
+
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
@@ -17,11 +19,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 /* if we have four sound sources (mic, three buffers) then we should
    divide all sounds by 4 before giving them to the speaker.
-   Unfortunately, that's too soft on my system, so we only divide by
-   2.  There is some danger of clipping. */
+   Unfortunately, that's too soft on my system.  Now that the output
+   goes through a limiter we can leave everything at full volume. */
 #define VOLUME_DECREASE 1
 
 /* hardcoded sample rate so we can make buffer sizes depend on the
@@ -32,17 +36,25 @@
 /* how long one buffer is */
 #define AMT_MEM SECONDS_OF_RECORDING*SAMPLE_RATE
 
+/* back the audio buffers with huge pages if the kernel will give us
+   any.  We ask for explicit MAP_HUGETLB pages first and fall back to
+   transparent huge pages.  Set to 0 to use ordinary pages. */
+#define USE_HUGE_PAGES 1
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
 /* there are three loop buffers represented in loop_bufs.  They are at
-   offsets 0, AMT_MEM, and 2*AMT_MEM */
-jack_default_audio_sample_t loop_bufs[AMT_MEM*3]; // three buffers
-jack_default_audio_sample_t potato_loop[AMT_MEM]; // simple lead buffer
+   offsets 0, AMT_MEM, and 2*AMT_MEM.  Allocated, locked, and
+   prefaulted by alloc_audio_mem() before we go realtime. */
+jack_default_audio_sample_t *loop_bufs; // three buffers
+jack_default_audio_sample_t *potato_loop; // simple lead buffer
 
 /* where in the loop buffer we're playing/recording from.  We start at
    0 when we record the first loop.*/
 int loop_pos = 0;
 
 /* where in the loop buffer to go back around to the beginning again.
-   Will be a multiple of nframes 
+   Doesn't need to be a multiple of nframes: everything that reads or
+   writes the loop goes through a ring.
    
    loop_end will be 64 beats times the interbeat sample length.
 
@@ -119,6 +131,394 @@ int state = S_OFF;
    ignored. */
 int pedal_states[3];
 
+/* we keep a running history of the input so that a pedal pressed a
+   little after the top of the loop can still record the whole loop.
+   HISTORY_LEN is how much input we keep, LATE_WINDOW is how long
+   after the top of the loop a press still counts as "at the top".
+   LATE_WINDOW must not be longer than HISTORY_LEN. */
+#define HISTORY_LEN (SAMPLE_RATE*4)
+#define LATE_WINDOW (SAMPLE_RATE/2)
+jack_default_audio_sample_t *history;
+int history_pos = 0; /* where the next input sample goes */
+
+/*** memory stuff ***/
+
+/* how much of the jack thread's stack to touch up front so growing
+   into it never faults */
+#define PREFAULT_STACK (256*1024)
+
+/* report how many page faults we've taken so far.  Once we're running
+   these numbers shouldn't move. */
+void print_faults(const char *when)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("page faults %s: %ld minor, %ld major\n",
+	 when, usage.ru_minflt, usage.ru_majflt);
+}
+
+/* keep len bytes at mem in ram.  If the memlock rlimit won't stretch
+   that far we say so once and carry on: a loop that might get swapped
+   out beats not starting at all. */
+void lock_buffer(void *mem, size_t len)
+{
+  static int warned = 0;
+
+  if (mlock(mem, len) && !warned) {
+    perror("mlock audio memory (raise ulimit -l?)");
+    warned = 1;
+  }
+}
+
+/* get n_samples of zeroed audio memory, on huge pages if we can.  The
+   memory is written once here so that process() never has to take a
+   fault the first time it records into a page. */
+jack_default_audio_sample_t *alloc_audio_mem(size_t n_samples)
+{
+  size_t len = n_samples * sizeof(jack_default_audio_sample_t);
+  void *mem = MAP_FAILED;
+
+#if USE_HUGE_PAGES
+  mem = mmap(NULL, (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE,
+	     PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem == MAP_FAILED) {
+    printf("no hugetlb pages, trying transparent huge pages\n");
+  }
+#endif
+  if (mem == MAP_FAILED) {
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      perror("mmap audio memory");
+      exit(1);
+    }
+#if USE_HUGE_PAGES
+    madvise(mem, len, MADV_HUGEPAGE);
+#endif
+  }
+
+  memset(mem, 0, len);
+  lock_buffer(mem, len);
+  return mem;
+}
+
+/* keep the code and libraries we have now in ram.  Only with no
+   memlock limit do we also lock everything we map later: with a limit,
+   MCL_FUTURE makes a big mmap past it fail outright instead of just
+   going unlocked.  Either way each buffer gets locked as it's mapped. */
+void lock_memory()
+{
+  struct rlimit limit;
+  int flags = MCL_CURRENT;
+
+  getrlimit(RLIMIT_MEMLOCK, &limit);
+  if (limit.rlim_cur == RLIM_INFINITY) {
+    flags |= MCL_FUTURE;
+  }
+  else {
+    printf("memlock limit %lu KB: locking buffers one at a time\n",
+	   (unsigned long)(limit.rlim_cur / 1024));
+  }
+  if (mlockall(flags)) {
+    perror("mlockall (raise ulimit -l?)");
+  }
+}
+
+/* runs in the jack thread before its first process().  Touch and lock
+   the stack it's going to grow into. */
+void thread_init(void *arg)
+{
+  volatile char stack[PREFAULT_STACK];
+
+  for (int i = 0 ; i < PREFAULT_STACK ; i += 4096) {
+    stack[i] = 0;
+  }
+  lock_buffer((void *)stack, PREFAULT_STACK);
+}
+
+/*** ring stuff ***/
+
+/* Loops, and the input history, are rings: a window of n samples
+   starting at pos can run off the end and carry on from the start.
+   ring_spans() splits a window into at most two contiguous spans so
+   the loops that do the actual work never need a modulo or a bounds
+   check, and loops don't need to be a multiple of nframes long. */
+struct ring {
+  jack_default_audio_sample_t *buf;
+  int len;
+};
+
+struct span {
+  jack_default_audio_sample_t *buf;
+  int len;
+};
+
+/* fill in the spans for [pos, pos+n) and return how many there are.
+   n must be no more than r.len */
+int ring_spans(struct ring r, int pos, int n, struct span spans[2])
+{
+  if (pos < 0 || pos >= r.len) {
+    pos %= r.len;
+    if (pos < 0) { pos += r.len; }
+  }
+
+  spans[0].buf = r.buf + pos;
+  if (n <= r.len - pos) {
+    spans[0].len = n;
+    return 1;
+  }
+  spans[0].len = r.len - pos;
+  spans[1].buf = r.buf;
+  spans[1].len = n - spans[0].len;
+  return 2;
+}
+
+/* out[0, n) += ring[pos, pos+n) * gain */
+void ring_mix(struct ring r, int pos, jack_default_audio_sample_t *out,
+	      int n, float gain)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      jack_default_audio_sample_t *src = spans[s].buf;
+      for (int i = 0 ; i < spans[s].len ; i++) {
+	out[i] += src[i] * gain;
+      }
+      out += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* out[0, n) = ring[pos, pos+n) */
+void ring_read(struct ring r, int pos, jack_default_audio_sample_t *out, int n)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      memcpy(out, spans[s].buf, spans[s].len * sizeof(*out));
+      out += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* ring[pos, pos+n) = in[0, n) */
+void ring_write(struct ring r, int pos, jack_default_audio_sample_t *in, int n)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      memcpy(spans[s].buf, in, spans[s].len * sizeof(*in));
+      in += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* the ring holding the track for this pedal */
+struct ring track_ring(int pedal, int len)
+{
+  struct ring r = {loop_bufs + AMT_MEM*pedal, len};
+  return r;
+}
+
+/* the potato loop, played round and round every len samples */
+struct ring potato_ring(int len)
+{
+  struct ring r = {potato_loop, len};
+  return r;
+}
+
+struct ring history_ring()
+{
+  struct ring r = {history, HISTORY_LEN};
+  return r;
+}
+
+/*** limiter stuff ***/
+
+/* Everything going to output passes through a lookahead limiter, so
+   we can leave the tracks at full volume and still not clip the PA.
+   We look LIMITER_LOOKAHEAD samples ahead: the output is delayed by
+   that much, and we tell jack so it can compensate.  Peaks are
+   estimated between samples too (true peak), by interpolating the
+   midpoint between each pair of samples.
+
+   For each sample we work out the gain it needs, hold the smallest
+   over a little more than the lookahead, and average that over a
+   little less.  That gets the gain all the way down by the time the
+   peak (and the samples either side of it) come out of the delay,
+   with a ramp instead of a step.  Gain comes back up with an
+   exponential release. */
+#define LIMITER_LOOKAHEAD 64
+#define HOLD_LEN (LIMITER_LOOKAHEAD + 1)
+#define BOX_LEN (LIMITER_LOOKAHEAD - 1)
+#define LIMITER_CEILING 0.89 /* -1dBFS */
+#define LIMITER_RELEASE_MS 100
+
+/* how often to say how hard the limiter has been working */
+#define LIMITER_REPORT_SECONDS 10
+
+/* we work through each cycle this many samples at a time */
+#define LIMITER_BLOCK 256
+
+jack_default_audio_sample_t limiter_delay_buf[LIMITER_LOOKAHEAD + LIMITER_BLOCK];
+int limiter_delay_pos = 0;
+
+/* the last three input samples, for the midpoint estimate */
+float limiter_x1, limiter_x2, limiter_x3;
+
+/* sliding minimum over the lookahead window, as a monotonic queue:
+   values increase from head to tail */
+float hold_vals[HOLD_LEN];
+long long hold_when[HOLD_LEN];
+int hold_head = 0, hold_len = 0;
+long long limiter_n = 0;
+
+/* running box average of the held gain */
+float box_vals[BOX_LEN];
+int box_pos = 0;
+double box_sum = 0;
+
+float limiter_gain = 1;
+
+/* start out at unity gain */
+void limiter_init()
+{
+  for (int i = 0 ; i < BOX_LEN ; i++) { box_vals[i] = 1; }
+  box_sum = BOX_LEN;
+}
+
+/* lowest gain since someone last looked, for telemetry */
+volatile float limiter_min_gain = 1;
+
+float limiter_need[LIMITER_BLOCK];
+float limiter_gains[LIMITER_BLOCK];
+jack_default_audio_sample_t limiter_delayed[LIMITER_BLOCK];
+
+void limit_block(jack_default_audio_sample_t *buf, int n)
+{
+  float release = 1 - expf(-1000.0 / (LIMITER_RELEASE_MS * SAMPLE_RATE));
+  struct ring delay = {limiter_delay_buf, LIMITER_LOOKAHEAD + LIMITER_BLOCK};
+
+  /* the gain each sample needs.  The midpoint between the two previous
+     samples is interpolated from the four around it, so we're one
+     sample behind on peaks; the lookahead covers that. */
+  float x1 = limiter_x1, x2 = limiter_x2, x3 = limiter_x3;
+  for (int i = 0 ; i < n ; i++) {
+    float x0 = buf[i];
+    float mid = (9 * (x1 + x2) - x0 - x3) / 16;
+    float peak = fmaxf(fabsf(x0), fabsf(mid));
+    limiter_need[i] = peak > LIMITER_CEILING ? LIMITER_CEILING / peak : 1;
+    x3 = x2; x2 = x1; x1 = x0;
+  }
+  limiter_x1 = x1; limiter_x2 = x2; limiter_x3 = x3;
+
+  /* hold the minimum, average it, release */
+  float gain = limiter_gain, lowest = limiter_min_gain;
+  for (int i = 0 ; i < n ; i++) {
+    long long now = limiter_n++;
+
+    while (hold_len > 0 &&
+	   hold_vals[(hold_head + hold_len - 1) % HOLD_LEN] >= limiter_need[i]) {
+      hold_len--;
+    }
+    if (hold_len > 0 && hold_when[hold_head] <= now - HOLD_LEN) {
+      hold_head = (hold_head + 1) % HOLD_LEN;
+      hold_len--;
+    }
+    int tail = (hold_head + hold_len++) % HOLD_LEN;
+    hold_vals[tail] = limiter_need[i];
+    hold_when[tail] = now;
+    float held = hold_vals[hold_head];
+
+    box_sum += held - box_vals[box_pos];
+    box_vals[box_pos] = held;
+    if (++box_pos == BOX_LEN) { box_pos = 0; }
+    float target = box_sum / BOX_LEN;
+
+    gain = target < gain ? target : gain + release * (target - gain);
+    limiter_gains[i] = gain;
+    if (gain < lowest) { lowest = gain; }
+  }
+  limiter_gain = gain;
+  limiter_min_gain = lowest;
+
+  /* delay the audio to line up with its gain, and apply it */
+  ring_write(delay, limiter_delay_pos, buf, n);
+  ring_read(delay, limiter_delay_pos - LIMITER_LOOKAHEAD, limiter_delayed, n);
+  limiter_delay_pos = (limiter_delay_pos + n) % delay.len;
+  for (int i = 0 ; i < n ; i++) {
+    buf[i] = limiter_delayed[i] * limiter_gains[i];
+  }
+}
+
+void limit(jack_default_audio_sample_t *buf, int nframes)
+{
+  for (int base = 0 ; base < nframes ; base += LIMITER_BLOCK) {
+    limit_block(buf + base, nframes - base < LIMITER_BLOCK ? nframes - base : LIMITER_BLOCK);
+  }
+}
+
+/* the limiter delays output, so tell jack about it */
+void latency_callback(jack_latency_callback_mode_t mode, void *arg)
+{
+  jack_latency_range_t range;
+
+  if (mode == JackCaptureLatency) {
+    jack_port_get_latency_range (input_port, mode, &range);
+    range.min += LIMITER_LOOKAHEAD;
+    range.max += LIMITER_LOOKAHEAD;
+    jack_port_set_latency_range (output_port, mode, &range);
+  }
+  else {
+    jack_port_get_latency_range (output_port, mode, &range);
+    range.min += LIMITER_LOOKAHEAD;
+    range.max += LIMITER_LOOKAHEAD;
+    jack_port_set_latency_range (input_port, mode, &range);
+  }
+}
+
+/* how much the limiter has turned things down since we last asked */
+void print_limiter()
+{
+  float lowest = limiter_min_gain;
+  limiter_min_gain = 1;
+  if (lowest < 1) {
+    printf("limiter: %.1f dB gain reduction\n", -20 * log10f(lowest));
+  }
+}
+
+/* a pedal was pressed loop_pos samples after the top of the loop:
+   copy what we heard since the top out of the history into this
+   pedal's buffer, as if we'd been recording all along. */
+void record_from_history(int pedal)
+{
+  struct span spans[2];
+  int n_spans = ring_spans(history_ring(), history_pos - loop_pos, loop_pos, spans);
+  int dst = 0;
+
+  for (int s = 0 ; s < n_spans ; s++) {
+    memcpy(&loop_bufs[AMT_MEM*pedal + dst], spans[s].buf,
+	   spans[s].len * sizeof(jack_default_audio_sample_t));
+    dst += spans[s].len;
+  }
+}
+
 /* figure out which button is active, if any.  Returns one of MOUSE_A, MOUSE_4, MOUSE_3, or MOUSE_None */
 int get_mouse()
 {
@@ -193,6 +593,12 @@ void respond_to_mouse(int mouse_press, int nframes) {
   case S_RUN:
     switch(pedal_states[mouse_press]){
     case pS_OFF:
+      if (loop_pos > 0 && loop_pos < LATE_WINDOW) {
+	printf("late start recording %d (%d late)\n", mouse_press, loop_pos);
+	record_from_history(mouse_press);
+	pedal_states[mouse_press] = pS_REC;
+	break;
+      }
       printf("waiting to record %d\n", mouse_press);
       pedal_states[mouse_press] = pS_WREC;
       break;
@@ -228,6 +634,10 @@ int process (jack_nframes_t nframes, void *arg)
 	for (int i = 0 ; i < nframes ; i++) {
 	  out[i] = in[i] / VOLUME_DECREASE;
 	}
+
+	/* always keep the input history, whatever state we're in */
+	ring_write(history_ring(), history_pos, in, nframes);
+	history_pos = (history_pos + nframes) % HISTORY_LEN;
 	
 	switch (state) {
 	case S_OFF:
@@ -241,9 +651,7 @@ int process (jack_nframes_t nframes, void *arg)
 	    printf("potatoes timed out\n");
 	    state = S_OFF;
 	  }
-	  for (int i = 0 ; i < nframes ; i++) {
-	    potato_loop[loop_pos + i] = in[i];
-	  }
+	  ring_write(potato_ring(AMT_MEM), loop_pos, in, nframes);
 	  loop_pos += nframes;
 
 	  break;
@@ -279,47 +687,54 @@ int process (jack_nframes_t nframes, void *arg)
 	    printf("              %d\n", (loop_pos / (loop_end / 64)));
 	  }
 
-	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	  /* where in this block the top of the loop is, if it's here.
+	     Tracks change state on exactly that frame: the block is done
+	     in two pieces either side of it. */
+	  int top = nframes;
+	  if (loop_pos == 0) { top = 0; }
+	  else if (loop_pos + nframes > loop_end) { top = loop_end - loop_pos; }
 
-	    if (loop_pos == 0) {
-	      if (pedal_states[pedal] == pS_WREC) {
-		printf ("recording secondary %d\n", pedal);
-		pedal_states[pedal] = pS_REC;
+	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	    for (int off = 0 ; off < nframes ; ) {
+	      int n = off < top ? top - off : nframes - off;
+
+	      if (off == top) {
+		if (pedal_states[pedal] == pS_WREC) {
+		  printf ("recording secondary %d\n", pedal);
+		  pedal_states[pedal] = pS_REC;
+		}
+		else if (pedal_states[pedal] == pS_REC) {
+		  printf ("playing secondary %d\n", pedal);
+		  pedal_states[pedal] = pS_PLY;
+		}
 	      }
-	      else if (pedal_states[pedal] == pS_REC) {
-		printf ("playing secondary %d\n", pedal);
-                pedal_states[pedal] = pS_PLY;
-              }
-	    }
 
-	    if (pedal_states[pedal] == pS_PLY) {
-	      for (int i = 0 ; i < nframes ; i++) {
-		out[i] += loop_bufs[AMT_MEM*pedal + loop_pos + i] / VOLUME_DECREASE;
+	      if (pedal_states[pedal] == pS_PLY) {
+		ring_mix(track_ring(pedal, loop_end), loop_pos + off, out + off, n,
+			 1.0 / VOLUME_DECREASE);
 	      }
-	    }
-	    else if (pedal_states[pedal] == pS_REC) {
-	      for (int i = 0 ; i < nframes ; i++) {
-		loop_bufs[AMT_MEM*pedal + loop_pos + i] = in[i];
+	      else if (pedal_states[pedal] == pS_REC) {
+		ring_write(track_ring(pedal, loop_end), loop_pos + off, in + off, n);
 	      }
+	      off += n;
 	    }
-
 	  }
 
 
-	  if (state != S_OFF &&
+	  if (state != S_OFF && potato_loop_end > 0 &&
 	      pedal_states[0] != pS_PLY &&
 	      pedal_states[1] != pS_PLY &&
 	      pedal_states[2] != pS_PLY){
-	    for (int i = 0 ; i < nframes ; i++) {
-	      out[i] += potato_loop[(loop_pos%potato_loop_end) + i] *2;
-	    }
+	    ring_mix(potato_ring(potato_loop_end), loop_pos, out, nframes, 2);
 	  }
 
 	  loop_pos += nframes;
 	  break;
 	}
 	
-	if (state == S_RUN && loop_pos >= loop_end) { loop_pos = 0 ;}
+	limit(out, nframes);
+
+	if (state == S_RUN && loop_pos >= loop_end) { loop_pos -= loop_end ;}
 	if (loop_pos >= AMT_MEM) {
 	  printf("ERROR: loop_pos >= AMT_MEM %d %d\n", loop_pos, AMT_MEM);
 	  loop_pos = 0;
@@ -352,6 +767,14 @@ int main (int argc, char *argv[])
 	jack_options_t options = JackNullOption;
 	jack_status_t status;
 
+	/* get all our audio memory in place before we go realtime */
+	print_faults("at startup");
+	lock_memory();
+	loop_bufs = alloc_audio_mem(AMT_MEM*3);
+	history = alloc_audio_mem(HISTORY_LEN);
+	potato_loop = alloc_audio_mem(AMT_MEM);
+	limiter_init();
+
 	/* open the mouse nonblocking.  We'll poll it each time we process a frame */
 	if ((mouse_fd = open(argv[1], O_RDONLY | O_NONBLOCK)) == -1){
 	  fprintf (stderr, "open mouse %s failed\n", argv[1]);
@@ -375,8 +798,12 @@ int main (int argc, char *argv[])
 	/* tell the JACK server to call `process()' whenever
 	   there is work to be done.
 	*/
+	jack_set_thread_init_callback (client, thread_init, 0);
 	jack_set_process_callback (client, process, 0);
 
+	/* and `latency_callback()' so we can tell it about the limiter */
+	jack_set_latency_callback (client, latency_callback, 0);
+
 	/* tell the JACK server to call `jack_shutdown()' if
 	   it ever shuts down, either entirely, or if it
 	   just decides to stop calling us.
@@ -405,6 +832,8 @@ int main (int argc, char *argv[])
 		exit (1);
 	}
 
+	print_faults("before activation");
+
 	/* Tell the JACK server that we are ready to roll.  Our
 	 * process() callback will start running now. */
 	if (jack_activate (client)) {
@@ -445,9 +874,15 @@ int main (int argc, char *argv[])
 
 	free (ports);
 
-	/* keep running until stopped by the user */
+	print_faults("after activation");
+
+	/* keep running until stopped by the user, letting them know
+	   when the limiter's been working */
 
-	sleep (-1);
+	while (1) {
+	  sleep (LIMITER_REPORT_SECONDS);
+	  print_limiter();
+	}
 
 	/* this is never reached but if the program
 	   had some other way to exit besides being killed,
@@ -4,6 +4,8 @@
  * as they would be used by many applications.
  */
 
+#define _GNU_SOURCE /* for MAP_HUGETLB and friends */
+
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
@@ -15,12 +17,22 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <signal.h>
 
 /* if we have four sound sources (mic, three buffers) then we should
    divide all sounds by 4 before giving them to the speaker.
-   Unfortunately, that's too soft on my system, so we only divide by
-   2.  There is some danger of clipping. */
-#define VOLUME_DECREASE 2
+   Unfortunately, that's too soft on my system.  Now that the output
+   goes through a limiter we can leave everything at full volume. */
+#define VOLUME_DECREASE 1
 
 /* hardcoded sample rate so we can make buffer sizes depend on the
    number of samples in 60 seconds */
@@ -30,9 +42,16 @@
 /* how long one buffer is */
 #define AMT_MEM SECONDS_OF_RECORDING*SAMPLE_RATE
 
+/* back the audio buffers with huge pages if the kernel will give us
+   any.  We ask for explicit MAP_HUGETLB pages first and fall back to
+   transparent huge pages.  Set to 0 to use ordinary pages. */
+#define USE_HUGE_PAGES 1
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
 /* there are three loop buffers represented in loop_bufs.  They are at
-   offsets 0, AMT_MEM, and 2*AMT_MEM */
-jack_default_audio_sample_t loop_bufs[AMT_MEM*3]; // three buffers
+   offsets 0, AMT_MEM, and 2*AMT_MEM.  Allocated, locked, and
+   prefaulted by alloc_audio_mem() before we go realtime. */
+jack_default_audio_sample_t *loop_bufs; // three buffers
 
 /* which of the three loops is the one that we're synching all the
    other loops to.  If this loop is stopped we'll try to make another
@@ -44,8 +63,9 @@ int primary;
 int loop_pos = 0;
 
 /* where in the loop buffer to go back around to the beginning again.
-   Will be a multiple of nframes 
-   
+   Doesn't need to be a multiple of nframes: everything that reads or
+   writes the loop goes through a ring.
+
    There's only one loop length at once.  All loops repeat on the same
    cycle.
 
@@ -54,203 +74,3925 @@ int loop_pos = 0;
 */
 int loop_end = 0;
 
-/* we have three mouse buttons.  On my fake external mouse they're named "all pass", "4", and "3". */
-#define MOUSE_A 0
-#define MOUSE_4 1
-#define MOUSE_3 2
-#define MOUSE_None -1
+/* we have three mouse buttons.  On my fake external mouse they're named "all pass", "4", and "3". */
+#define MOUSE_A 0
+#define MOUSE_4 1
+#define MOUSE_3 2
+#define MOUSE_None -1
+
+/*** jack stuff ***/
+jack_port_t *input_port;
+jack_port_t *output_port;
+jack_client_t *client;
+
+/* give each track, and the dry input, its own output port as well as
+   summing everything into output, so they can be mixed separately.
+   Set to 0 for just the one output. */
+#define TRACK_PORTS 1
+jack_port_t *track_ports[3];
+jack_port_t *dry_port;
+
+/*** mouse stuff ***/
+#define MAX_MOUSE_READ 1024
+int amt_read_mouse = 0;
+char mouse_buf[MAX_MOUSE_READ];
+int mouse_fd;
+
+/* most button changes we'll take in one cycle */
+#define MAX_BUTTON_EVENTS 8
+
+/* how long a press has to be to count as long, how close together
+   two taps have to be to count as a double, and how close together
+   pedals have to go down to count as a chord.  These are also how
+   long a tap can be held up deciding, see gesture stuff. */
+#define LONG_PRESS_MS 400
+#define DOUBLE_TAP_MS 250
+#define CHORD_MS 30
+
+struct pedal_gesture {
+  int down;
+  long long down_at, up_at;
+  int pending; /* down, and we haven't decided what it is yet */
+  int chording; /* down, and another pedal could still make it a chord */
+  int tapped;  /* tapped once, waiting to see if it's a double */
+};
+
+struct gestures {
+  int down;       /* pedals down now */
+  int chord;      /* pedals that have been down together */
+  int chord_done; /* fired, waiting for everything to come up */
+  struct pedal_gesture pedals[3];
+} gestures;
+
+/* a command from the control plane, see control stuff */
+struct command {
+  int type;
+  int track, arg;
+  float value;
+};
+
+/* most commands we'll take in one cycle */
+#define MAX_CONTROL_CMDS 8
+
+/* everything the engine is told each cycle, apart from the audio */
+struct cycle_input {
+  int n_buttons;
+  int buttons[MAX_BUTTON_EVENTS];
+  int n_cmds;
+  struct command cmds[MAX_CONTROL_CMDS];
+};
+
+/*** state stuff ***/
+
+/* we have two kinds of state: main (int state) and per pedal (int
+   pedal_states[3]).  Allowed states are:
+
+   main     pedal_state
+   ----     -----------
+   OFF      OFF
+   PRI_REC  one state (primary) is in REC, all others in OFF
+   PLY      one state (primary) is in PLY, all others in any of OFF,
+            WAIT_REC, REC, or PLY
+
+*/
+
+/* nothing playing */
+#define STATE_OFF 201
+
+/* recording the primary track.  This is the recording that sets the
+   loop length */
+#define STATE_PRI_REC 202
+
+/* running normally.  Playing at least one track (primary), possibly
+   recording or playing others, a loop length is defined */
+#define STATE_PLY 203
+
+/* main state */
+int state = STATE_OFF;
+
+/* this pedal is off */
+#define pSTATE_OFF 301
+
+/* this pedal is not primary, it's been pressed, and we're waiting for
+   the beginning of the loop before we start recording. */
+#define pSTATE_WAIT_REC 302
+
+/* we're recording to the buffer for this pedal */
+#define pSTATE_REC 303
+
+/* we're playing from the buffer for this pedal */
+#define pSTATE_PLY 304
+
+/* individual pedal states.  If the main state is OFF then these are
+   ignored.  When the main state becomes PRI_REC all but primary is
+   set to OFF */
+int pedal_states[3];
+
+/* which tracks have something in them at the current loop length */
+int track_recorded[3];
+
+/* frames the engine has run, for timing gestures */
+long long frames_run = 0;
+
+/* we keep a running history of the input so that a pedal pressed a
+   little after the top of the loop can still record the whole loop.
+   HISTORY_LEN is how much input we keep, LATE_WINDOW is how long
+   after the top of the loop a press still counts as "at the top".
+   LATE_WINDOW must not be longer than HISTORY_LEN. */
+#define HISTORY_LEN (SAMPLE_RATE*4)
+#define LATE_WINDOW (SAMPLE_RATE/2)
+jack_default_audio_sample_t *history;
+int history_pos = 0; /* where the next input sample goes */
+
+/*** memory stuff ***/
+
+/* how much of the jack thread's stack to touch up front so growing
+   into it never faults */
+#define PREFAULT_STACK (256*1024)
+
+/* report how many page faults we've taken so far.  Once we're running
+   these numbers shouldn't move. */
+void print_faults(const char *when)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("page faults %s: %ld minor, %ld major\n",
+	 when, usage.ru_minflt, usage.ru_majflt);
+}
+
+/* keep len bytes at mem in ram.  If the memlock rlimit won't stretch
+   that far we say so once and carry on: a loop that might get swapped
+   out beats not starting at all. */
+void lock_buffer(void *mem, size_t len)
+{
+  static int warned = 0;
+
+  if (mlock(mem, len) && !warned) {
+    perror("mlock audio memory (raise ulimit -l?)");
+    warned = 1;
+  }
+}
+
+/* get len bytes of zeroed memory, on huge pages if we can.  The
+   memory is written once here so that process() never has to take a
+   fault the first time it records into a page. */
+void *alloc_locked_mem(size_t len)
+{
+  void *mem = MAP_FAILED;
+
+#if USE_HUGE_PAGES
+  mem = mmap(NULL, (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE,
+	     PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem == MAP_FAILED) {
+    printf("no hugetlb pages, trying transparent huge pages\n");
+  }
+#endif
+  if (mem == MAP_FAILED) {
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      perror("mmap audio memory");
+      exit(1);
+    }
+#if USE_HUGE_PAGES
+    madvise(mem, len, MADV_HUGEPAGE);
+#endif
+  }
+
+  memset(mem, 0, len);
+  lock_buffer(mem, len);
+  return mem;
+}
+
+jack_default_audio_sample_t *alloc_audio_mem(size_t n_samples)
+{
+  return alloc_locked_mem(n_samples * sizeof(jack_default_audio_sample_t));
+}
+
+/* keep the code and libraries we have now in ram.  Only with no
+   memlock limit do we also lock everything we map later: with a limit,
+   MCL_FUTURE makes a big mmap past it fail outright instead of just
+   going unlocked.  Either way each buffer gets locked as it's mapped. */
+void lock_memory()
+{
+  struct rlimit limit;
+  int flags = MCL_CURRENT;
+
+  getrlimit(RLIMIT_MEMLOCK, &limit);
+  if (limit.rlim_cur == RLIM_INFINITY) {
+    flags |= MCL_FUTURE;
+  }
+  else {
+    printf("memlock limit %lu KB: locking buffers one at a time\n",
+	   (unsigned long)(limit.rlim_cur / 1024));
+  }
+  if (mlockall(flags)) {
+    perror("mlockall (raise ulimit -l?)");
+  }
+}
+
+/* runs in the jack thread before its first process().  Touch and lock
+   the stack it's going to grow into. */
+void thread_init(void *arg)
+{
+  volatile char stack[PREFAULT_STACK];
+
+  for (int i = 0 ; i < PREFAULT_STACK ; i += 4096) {
+    stack[i] = 0;
+  }
+  lock_buffer((void *)stack, PREFAULT_STACK);
+}
+
+/*** kernel stuff ***/
+
+/* The loops that touch every sample (mixing tracks in, interpolating
+   for varispeed, scanning takes for peaks and silence) are built once
+   for each instruction set below, and at startup we pick the best one
+   this cpu has.  That way the same binary does well on an old Atom
+   netbook and on a new laptop.  "make bench" times them all here.
+
+   Every variant does its arithmetic in the same order, so they all
+   come out exactly the same: a flight recording replays bit exact
+   whichever one made it.  That's why we build with -ffp-contract=off
+   (no variant gets to fuse a multiply and an add) and why the sinc
+   sums its taps in KERNEL_LANES partial sums everywhere, scalar
+   included (on x86 that one is really just not auto-vectorized).
+   On 32 bit x86 that also needs -msse2 -mfpmath=sse, which the
+   Makefile adds: gcc's default there is x87 math with its extra
+   precision, and target("sse2") doesn't change that.
+
+   Copying into and out of the loop buffers is memcpy, which libc
+   already picks per cpu. */
+#if defined(__i386__) && !defined(__SSE2_MATH__)
+#warning "x87 float math: kernels won't match bit for bit, build with -msse2 -mfpmath=sse"
+#endif
+#define KERNEL_LANES 8
+#define SINC_TAPS 16 /* samples either side of the read position: 8 */
+
+/* gcc turns these into whatever vectors the variant has, or plain
+   floats */
+typedef float lanes __attribute__((vector_size(KERNEL_LANES * sizeof(float))));
+
+/* out[i] += in[i] * gain */
+static inline __attribute__((always_inline))
+void mix_body(float *restrict out, const float *restrict in, int n, float gain)
+{
+  for (int i = 0 ; i < n ; i++) {
+    out[i] += in[i] * gain;
+  }
+}
+
+/* out[i] = in[i] * gain */
+static inline __attribute__((always_inline))
+void scale_body(float *restrict out, const float *restrict in, int n, float gain)
+{
+  for (int i = 0 ; i < n ; i++) {
+    out[i] = in[i] * gain;
+  }
+}
+
+/* out[i] = w read at start + speed * i, linearly */
+static inline __attribute__((always_inline))
+void linear_body(float *restrict out, int n, const float *restrict w,
+		 double start, float speed)
+{
+  for (int i = 0 ; i < n ; i++) {
+    double pos = start + speed * i;
+    int k = pos;
+    float f = pos - k;
+    out[i] = w[k] + f * (w[k + 1] - w[k]);
+  }
+}
+
+/* the same through a table of sinc taps for each of phases fractional
+   positions */
+static inline __attribute__((always_inline))
+void sinc_body(float *restrict out, int n, const float *restrict w,
+	       double start, float speed, float (*table)[SINC_TAPS], int phases)
+{
+  for (int i = 0 ; i < n ; i++) {
+    double pos = start + speed * i;
+    int k = pos;
+    int phase = (pos - k) * phases + 0.5;
+    const float *x = w + k - (SINC_TAPS/2 - 1);
+    const float *taps = table[phase];
+    lanes acc = {0}, a, b;
+
+    for (int j = 0 ; j < SINC_TAPS ; j += KERNEL_LANES) {
+      memcpy(&a, x + j, sizeof(a));
+      memcpy(&b, taps + j, sizeof(b));
+      acc += a * b;
+    }
+    out[i] = ((acc[0] + acc[4]) + (acc[2] + acc[6])) +
+      ((acc[1] + acc[5]) + (acc[3] + acc[7]));
+  }
+}
+
+/* the smallest and largest of in[0, n), n at least 1 */
+static inline __attribute__((always_inline))
+void range_body(const float *restrict in, int n, float *lo, float *hi)
+{
+  float l[KERNEL_LANES], h[KERNEL_LANES];
+  int i = 0;
+
+  for (int j = 0 ; j < KERNEL_LANES ; j++) {
+    l[j] = h[j] = in[0];
+  }
+  for ( ; i + KERNEL_LANES <= n ; i += KERNEL_LANES) {
+    for (int j = 0 ; j < KERNEL_LANES ; j++) {
+      l[j] = in[i + j] < l[j] ? in[i + j] : l[j];
+      h[j] = in[i + j] > h[j] ? in[i + j] : h[j];
+    }
+  }
+  for ( ; i < n ; i++) {
+    l[0] = in[i] < l[0] ? in[i] : l[0];
+    h[0] = in[i] > h[0] ? in[i] : h[0];
+  }
+  for (int j = 1 ; j < KERNEL_LANES ; j++) {
+    l[0] = l[j] < l[0] ? l[j] : l[0];
+    h[0] = h[j] > h[0] ? h[j] : h[0];
+  }
+  *lo = l[0];
+  *hi = h[0];
+}
+
+struct kernels {
+  const char *name;
+  int (*usable)();
+  void (*mix)(float *restrict out, const float *restrict in, int n, float gain);
+  void (*scale)(float *restrict out, const float *restrict in, int n, float gain);
+  void (*linear)(float *restrict out, int n, const float *restrict w,
+		 double start, float speed);
+  void (*sinc)(float *restrict out, int n, const float *restrict w,
+	       double start, float speed, float (*table)[SINC_TAPS], int phases);
+  void (*range)(const float *restrict in, int n, float *lo, float *hi);
+};
+
+/* one copy of every kernel, built with attrs */
+#define KERNELS(isa, attrs, usable)					\
+  attrs void mix_##isa(float *restrict out, const float *restrict in,	\
+		       int n, float gain)				\
+  { mix_body(out, in, n, gain); }					\
+  attrs void scale_##isa(float *restrict out, const float *restrict in, \
+			 int n, float gain)				\
+  { scale_body(out, in, n, gain); }					\
+  attrs void linear_##isa(float *restrict out, int n, const float *restrict w, \
+			  double start, float speed)			\
+  { linear_body(out, n, w, start, speed); }				\
+  attrs void sinc_##isa(float *restrict out, int n, const float *restrict w, \
+			double start, float speed,			\
+			float (*table)[SINC_TAPS], int phases)		\
+  { sinc_body(out, n, w, start, speed, table, phases); }		\
+  attrs void range_##isa(const float *restrict in, int n,		\
+			 float *lo, float *hi)				\
+  { range_body(in, n, lo, hi); }					\
+  struct kernels isa##_kernels = {#isa, usable, mix_##isa, scale_##isa,	\
+				  linear_##isa, sinc_##isa, range_##isa};
+
+int cpu_any() { return 1; }
+KERNELS(scalar, __attribute__((optimize("no-tree-vectorize"))), cpu_any)
+
+#if defined(__x86_64__) || defined(__i386__)
+int cpu_sse2() { return __builtin_cpu_supports("sse2"); }
+int cpu_avx2() { return __builtin_cpu_supports("avx2"); }
+int cpu_avx512() { return __builtin_cpu_supports("avx512f"); }
+KERNELS(sse2, __attribute__((target("sse2"))), cpu_sse2)
+KERNELS(avx2, __attribute__((target("avx2"))), cpu_avx2)
+KERNELS(avx512, __attribute__((target("avx512f"))), cpu_avx512)
+#endif
+
+/* best first */
+struct kernels *all_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  &avx512_kernels, &avx2_kernels, &sse2_kernels,
+#endif
+  &scalar_kernels,
+};
+#define N_KERNELS (sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+/* the ones we're using */
+struct kernels *kern = &scalar_kernels;
+
+void kernels_init()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#endif
+  for (int k = 0 ; k < N_KERNELS ; k++) {
+    if (all_kernels[k]->usable()) {
+      kern = all_kernels[k];
+      break;
+    }
+  }
+  printf("using %s kernels\n", kern->name);
+}
+
+/*** ring stuff ***/
+
+/* Loops, and the input history, are rings: a window of n samples
+   starting at pos can run off the end and carry on from the start.
+   ring_spans() splits a window into at most two contiguous spans so
+   the loops that do the actual work never need a modulo or a bounds
+   check, and loops don't need to be a multiple of nframes long. */
+struct ring {
+  jack_default_audio_sample_t *buf;
+  int len;
+};
+
+struct span {
+  jack_default_audio_sample_t *buf;
+  int len;
+};
+
+/* fill in the spans for [pos, pos+n) and return how many there are.
+   n must be no more than r.len */
+int ring_spans(struct ring r, int pos, int n, struct span spans[2])
+{
+  if (pos < 0 || pos >= r.len) {
+    pos %= r.len;
+    if (pos < 0) { pos += r.len; }
+  }
+
+  spans[0].buf = r.buf + pos;
+  if (n <= r.len - pos) {
+    spans[0].len = n;
+    return 1;
+  }
+  spans[0].len = r.len - pos;
+  spans[1].buf = r.buf;
+  spans[1].len = n - spans[0].len;
+  return 2;
+}
+
+/* out[0, n) += ring[pos, pos+n) * gain */
+void ring_mix(struct ring r, int pos, jack_default_audio_sample_t *out,
+	      int n, float gain)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      kern->mix(out, spans[s].buf, spans[s].len, gain);
+      out += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* out[0, n) = ring[pos, pos+n) */
+void ring_read(struct ring r, int pos, jack_default_audio_sample_t *out, int n)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      memcpy(out, spans[s].buf, spans[s].len * sizeof(*out));
+      out += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* out[0, n) = ring[pos, pos+n) * gain */
+void ring_copy(struct ring r, int pos, jack_default_audio_sample_t *out,
+	       int n, float gain)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      kern->scale(out, spans[s].buf, spans[s].len, gain);
+      out += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* ring[pos, pos+n) = in[0, n) */
+void ring_write(struct ring r, int pos, jack_default_audio_sample_t *in, int n)
+{
+  struct span spans[2];
+
+  while (n > 0) {
+    int chunk = n < r.len ? n : r.len;
+    int n_spans = ring_spans(r, pos, chunk, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      memcpy(spans[s].buf, in, spans[s].len * sizeof(*in));
+      in += spans[s].len;
+    }
+    pos += chunk;
+    n -= chunk;
+  }
+}
+
+/* mix a playing track into the master.  If the track has its own
+   port it's written straight into that and summed from there. */
+void play_track(struct ring track, int pos, jack_default_audio_sample_t *out,
+		jack_default_audio_sample_t *track_out, int nframes, float gain)
+{
+  if (!track_out) {
+    ring_mix(track, pos, out, nframes, gain);
+    return;
+  }
+  ring_copy(track, pos, track_out, nframes, gain);
+  for (int i = 0 ; i < nframes ; i++) {
+    out[i] += track_out[i];
+  }
+}
+
+/* the ring holding the track for this pedal */
+struct ring track_ring(int pedal, int len)
+{
+  struct ring r = {loop_bufs + AMT_MEM*pedal, len};
+  return r;
+}
+
+struct ring history_ring()
+{
+  struct ring r = {history, HISTORY_LEN};
+  return r;
+}
+
+/*** limiter stuff ***/
+
+/* Everything going to output passes through a lookahead limiter, so
+   we can leave the tracks at full volume and still not clip the PA.
+   We look LIMITER_LOOKAHEAD samples ahead: the output is delayed by
+   that much, and we tell jack so it can compensate.  Peaks are
+   estimated between samples too (true peak), by interpolating the
+   midpoint between each pair of samples.
+
+   For each sample we work out the gain it needs, hold the smallest
+   over a little more than the lookahead, and average that over a
+   little less.  That gets the gain all the way down by the time the
+   peak (and the samples either side of it) come out of the delay,
+   with a ramp instead of a step.  Gain comes back up with an
+   exponential release. */
+#define LIMITER_LOOKAHEAD 64
+#define HOLD_LEN (LIMITER_LOOKAHEAD + 1)
+#define BOX_LEN (LIMITER_LOOKAHEAD - 1)
+#define LIMITER_CEILING 0.89 /* -1dBFS */
+#define LIMITER_RELEASE_MS 100
+
+/* we work through each cycle this many samples at a time */
+#define LIMITER_BLOCK 256
+
+jack_default_audio_sample_t limiter_delay_buf[LIMITER_LOOKAHEAD + LIMITER_BLOCK];
+int limiter_delay_pos = 0;
+
+/* the last three input samples, for the midpoint estimate */
+float limiter_x1, limiter_x2, limiter_x3;
+
+/* sliding minimum over the lookahead window, as a monotonic queue:
+   values increase from head to tail */
+float hold_vals[HOLD_LEN];
+long long hold_when[HOLD_LEN];
+int hold_head = 0, hold_len = 0;
+long long limiter_n = 0;
+
+/* running box average of the held gain */
+float box_vals[BOX_LEN];
+int box_pos = 0;
+double box_sum = 0;
+
+float limiter_gain = 1;
+
+/* start out at unity gain */
+void limiter_init()
+{
+  for (int i = 0 ; i < BOX_LEN ; i++) { box_vals[i] = 1; }
+  box_sum = BOX_LEN;
+}
+
+/* lowest gain since someone last looked, for telemetry */
+volatile float limiter_min_gain = 1;
+
+float limiter_need[LIMITER_BLOCK];
+float limiter_gains[LIMITER_BLOCK];
+jack_default_audio_sample_t limiter_delayed[LIMITER_BLOCK];
+
+void limit_block(jack_default_audio_sample_t *buf, int n)
+{
+  float release = 1 - expf(-1000.0 / (LIMITER_RELEASE_MS * SAMPLE_RATE));
+  struct ring delay = {limiter_delay_buf, LIMITER_LOOKAHEAD + LIMITER_BLOCK};
+
+  /* the gain each sample needs.  The midpoint between the two previous
+     samples is interpolated from the four around it, so we're one
+     sample behind on peaks; the lookahead covers that. */
+  float x1 = limiter_x1, x2 = limiter_x2, x3 = limiter_x3;
+  for (int i = 0 ; i < n ; i++) {
+    float x0 = buf[i];
+    float mid = (9 * (x1 + x2) - x0 - x3) / 16;
+    float peak = fmaxf(fabsf(x0), fabsf(mid));
+    limiter_need[i] = peak > LIMITER_CEILING ? LIMITER_CEILING / peak : 1;
+    x3 = x2; x2 = x1; x1 = x0;
+  }
+  limiter_x1 = x1; limiter_x2 = x2; limiter_x3 = x3;
+
+  /* hold the minimum, average it, release */
+  float gain = limiter_gain, lowest = limiter_min_gain;
+  for (int i = 0 ; i < n ; i++) {
+    long long now = limiter_n++;
+
+    while (hold_len > 0 &&
+	   hold_vals[(hold_head + hold_len - 1) % HOLD_LEN] >= limiter_need[i]) {
+      hold_len--;
+    }
+    if (hold_len > 0 && hold_when[hold_head] <= now - HOLD_LEN) {
+      hold_head = (hold_head + 1) % HOLD_LEN;
+      hold_len--;
+    }
+    int tail = (hold_head + hold_len++) % HOLD_LEN;
+    hold_vals[tail] = limiter_need[i];
+    hold_when[tail] = now;
+    float held = hold_vals[hold_head];
+
+    box_sum += held - box_vals[box_pos];
+    box_vals[box_pos] = held;
+    if (++box_pos == BOX_LEN) { box_pos = 0; }
+    float target = box_sum / BOX_LEN;
+
+    gain = target < gain ? target : gain + release * (target - gain);
+    limiter_gains[i] = gain;
+    if (gain < lowest) { lowest = gain; }
+  }
+  limiter_gain = gain;
+  limiter_min_gain = lowest;
+
+  /* delay the audio to line up with its gain, and apply it */
+  ring_write(delay, limiter_delay_pos, buf, n);
+  ring_read(delay, limiter_delay_pos - LIMITER_LOOKAHEAD, limiter_delayed, n);
+  limiter_delay_pos = (limiter_delay_pos + n) % delay.len;
+  for (int i = 0 ; i < n ; i++) {
+    buf[i] = limiter_delayed[i] * limiter_gains[i];
+  }
+}
+
+void limit(jack_default_audio_sample_t *buf, int nframes)
+{
+  for (int base = 0 ; base < nframes ; base += LIMITER_BLOCK) {
+    limit_block(buf + base, nframes - base < LIMITER_BLOCK ? nframes - base : LIMITER_BLOCK);
+  }
+}
+
+/* the limiter delays output, so tell jack about it */
+void latency_callback(jack_latency_callback_mode_t mode, void *arg)
+{
+  jack_latency_range_t range;
+
+  if (mode == JackCaptureLatency) {
+    jack_port_get_latency_range (input_port, mode, &range);
+    range.min += LIMITER_LOOKAHEAD;
+    range.max += LIMITER_LOOKAHEAD;
+    jack_port_set_latency_range (output_port, mode, &range);
+  }
+  else {
+    jack_port_get_latency_range (output_port, mode, &range);
+    range.min += LIMITER_LOOKAHEAD;
+    range.max += LIMITER_LOOKAHEAD;
+    jack_port_set_latency_range (input_port, mode, &range);
+  }
+}
+
+/* how much the limiter has turned things down since we last asked */
+void print_limiter()
+{
+  float lowest = limiter_min_gain;
+  limiter_min_gain = 1;
+  if (lowest < 1) {
+    printf("limiter: %.1f dB gain reduction\n", -20 * log10f(lowest));
+  }
+}
+
+/*** trace stuff ***/
+
+/* When we get an xrun it helps to know where the time went.  Build
+   with `make TRACE=1' and each phase of process(), and of the other
+   threads, records when it started and how long it took.  Every
+   thread writes into its own ring of events, so there's no locking;
+   send us SIGUSR1 and we write the recent history out to TRACE_FILE
+   as a Chrome trace (open it in chrome://tracing or Perfetto).  With
+   TRACE=0 the trace points compile to nothing. */
+
+long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifndef TRACE
+#define TRACE 0
+#endif
+
+#define TRACE_FILE "looper_trace.json"
+#define TRACE_EVENTS 65536 /* per thread, a power of two */
+#define MAX_TRACE_THREADS 8
+
+struct trace_event {
+  const char *name;
+  long long start, end; /* nanoseconds */
+};
+
+struct trace_buf {
+  const char *thread;
+  volatile unsigned head; /* total events ever written */
+  struct trace_event events[TRACE_EVENTS];
+};
+
+#if TRACE
+
+struct trace_buf trace_bufs[MAX_TRACE_THREADS];
+int n_trace_bufs = 0;
+__thread struct trace_buf *my_trace = NULL;
+
+/* give this thread its own buffer; call before it does anything else */
+void trace_thread(const char *name)
+{
+  int slot = __sync_fetch_and_add(&n_trace_bufs, 1);
+  if (slot >= MAX_TRACE_THREADS) {
+    my_trace = NULL;
+    return;
+  }
+  trace_bufs[slot].thread = name;
+  my_trace = &trace_bufs[slot];
+}
+
+void trace_event(const char *name, long long start, long long end)
+{
+  struct trace_buf *buf = my_trace;
+  if (!buf) { return; }
+
+  struct trace_event *event = &buf->events[buf->head & (TRACE_EVENTS - 1)];
+  event->name = name;
+  event->start = start;
+  event->end = end;
+  __sync_synchronize();
+  buf->head++;
+}
+
+#define TRACE_THREAD(name) do { if (!my_trace) { trace_thread(name); } } while (0)
+#define TRACE_BEGIN(t) long long t = now_ns()
+#define TRACE_END(t, name) trace_event(name, t, now_ns())
+
+#else
+
+#define TRACE_THREAD(name) do { } while (0)
+#define TRACE_BEGIN(t) do { } while (0)
+#define TRACE_END(t, name) do { } while (0)
+
+#endif
+
+volatile sig_atomic_t trace_wanted = 0;
+
+void trace_signal(int sig)
+{
+  trace_wanted = 1;
+}
+
+/* write out what every thread has been doing, as Chrome trace json.
+   We copy the events we're going to write first and skip the oldest
+   part of each ring, which its thread could be overwriting. */
+void dump_trace()
+{
+#if TRACE
+  FILE *f = fopen(TRACE_FILE, "w");
+  int n_bufs = n_trace_bufs < MAX_TRACE_THREADS ? n_trace_bufs : MAX_TRACE_THREADS;
+  int first = 1;
+
+  if (!f) {
+    perror("open " TRACE_FILE);
+    return;
+  }
+  fprintf(f, "{\"traceEvents\":[\n");
+  for (int t = 0 ; t < n_bufs ; t++) {
+    struct trace_buf *buf = &trace_bufs[t];
+    unsigned head = buf->head;
+    unsigned from = head > TRACE_EVENTS / 2 ? head - TRACE_EVENTS / 2 : 0;
+
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+	    "\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", t + 1, buf->thread);
+    first = 0;
+    for (unsigned i = from ; i < head ; i++) {
+      struct trace_event event = buf->events[i & (TRACE_EVENTS - 1)];
+      fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+	      "\"ts\":%.3f,\"dur\":%.3f}", event.name, t + 1,
+	      event.start / 1000.0, (event.end - event.start) / 1000.0);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  printf("wrote trace to %s\n", TRACE_FILE);
+#else
+  printf("built without TRACE=1, no trace to write\n");
+#endif
+}
+
+/*** overload stuff ***/
+
+/* If a cycle takes longer than jack's period we get an xrun and a
+   glitch.  So we watch our average cycle time, and as it gets close
+   to the period we shed load a step at a time:
+
+     1. bypass the effects
+     2. play varispeed tracks with linear instead of sinc interpolation
+     3. stop hashing our output for the flight recorder
+
+   We note how much each step saved, and put the last one back once
+   the cycle time plus that would leave some headroom.  The loops
+   themselves always play.  Steps are at least SHED_SETTLE_MS apart so
+   the average has time to catch up. */
+#define SHED_HIGH_PERCENT 85 /* shed a step above this much of the period */
+#define SHED_LOW_PERCENT 60  /* restore one if we'd stay under this */
+#define SHED_SETTLE_MS 500
+
+#define SHED_NONE 0
+#define SHED_FX 1
+#define SHED_INTERP 2
+#define SHED_HASH 3
+
+const char *shed_names[] = {"nothing", "effects", "sinc interpolation",
+			    "flight recorder hashing"};
+
+/* moving average of how long process() takes, in nanoseconds */
+double cycle_ns = 0;
+
+int shed = SHED_NONE;
+long long shed_changed = 0;            /* frames_run when we last moved */
+double shed_before_ns[SHED_HASH + 1];  /* cycle_ns when we shed a step */
+double shed_saved_ns[SHED_HASH + 1];   /* and what that saved, or -1 */
+
+/* move at most a step.  Returns the step just restored, if any. */
+int shed_update(jack_nframes_t nframes)
+{
+  double period_ns = 1e9 * nframes / SAMPLE_RATE;
+
+  if (frames_run - shed_changed < SHED_SETTLE_MS * SAMPLE_RATE / 1000) {
+    return SHED_NONE;
+  }
+  if (shed > SHED_NONE && shed_saved_ns[shed] < 0) {
+    double saved = shed_before_ns[shed] - cycle_ns;
+    shed_saved_ns[shed] = saved > 0 ? saved : 0;
+  }
+
+  if (cycle_ns > period_ns * SHED_HIGH_PERCENT / 100 && shed < SHED_HASH) {
+    shed++;
+    shed_before_ns[shed] = cycle_ns;
+    shed_saved_ns[shed] = -1;
+    shed_changed = frames_run;
+    printf("cycle %.0fns of %.0fns: shedding %s\n", cycle_ns, period_ns,
+	   shed_names[shed]);
+  }
+  else if (shed > SHED_NONE &&
+	   cycle_ns + shed_saved_ns[shed] < period_ns * SHED_LOW_PERCENT / 100) {
+    printf("cycle %.0fns of %.0fns: restoring %s\n", cycle_ns, period_ns,
+	   shed_names[shed]);
+    shed_changed = frames_run;
+    return shed--;
+  }
+  return SHED_NONE;
+}
+
+/*** polymeter stuff ***/
+
+/* Each track can be a different length from the base loop (the one
+   the primary sets), num/den of it: 3/4 for a three bar phrase over a
+   four bar loop.  Every track is worked out from how far we are since
+   the primary's top, so they all come back together on the common
+   multiple.  A track's loops start at ceil(k * loop_end * num / den),
+   which means they can differ by a sample when the division doesn't
+   come out even, but the track lands exactly back on the base loop
+   every num base loops.
+
+   The heads are worked out once per cycle; after that reading and
+   writing goes through rings like before, so a track's own wrap costs
+   no more than the base loop's did. */
+#define MAX_RATIO 8 /* biggest num or den */
+
+int track_num[3] = {1, 1, 1}, track_den[3] = {1, 1, 1};
+
+/* how many times we've come around the top of the base loop since
+   the primary started playing */
+int loop_count = 0;
+
+struct head {
+  int pos, len;   /* where the track is, and how long this time round */
+  long long loop; /* how many times round it's been */
+};
+
+/* where each track is this cycle */
+struct head heads[3];
+
+/* whether this track's length fits in its buffer at this base loop */
+int ratio_fits(int pedal, int num, int den)
+{
+  return (long long)loop_end * num <= (long long)AMT_MEM * den;
+}
+
+/* where a track is ahead frames into this cycle */
+struct head head_at(int pedal, int ahead)
+{
+  struct head h;
+  long long total = (long long)loop_count * loop_end + loop_pos + ahead;
+  int den = track_den[pedal];
+  long long super = (long long)loop_end * track_num[pedal];
+
+  if (state != STATE_PLY || !loop_end) {
+    /* recording the primary, or off: just the base loop, as long as
+       it can get */
+    h.pos = loop_pos + ahead;
+    h.len = AMT_MEM;
+    h.loop = 0;
+    return h;
+  }
+
+  long long in_super = total % super;
+  long long k = in_super * den / super;
+  long long start = (k * super + den - 1) / den;
+  long long next = ((k + 1) * super + den - 1) / den;
+  h.pos = in_super - start;
+  h.len = next - start;
+  h.loop = total / super * den + k;
+  return h;
+}
+
+void track_heads()
+{
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    heads[pedal] = head_at(pedal, 0);
+  }
+}
+
+/*** varispeed stuff ***/
+
+/* Tracks can play back at other speeds, including backwards, for the
+   usual octave down / octave up / reverse tricks.  Where a track reads
+   from is worked out fresh each block from where we are on the loop
+   grid, so it never drifts: at speed s the read position is
+   s * (pos + (loop % VARISPEED_PERIOD) * len) around the track, for
+   the track's head.  Speeds have to be multiples of 1/VARISPEED_PERIOD so
+   that comes back around to the same place every VARISPEED_PERIOD
+   loops.
+
+   Reading between samples is done either linearly or with a windowed
+   sinc, which is more expensive but doesn't dull the sound.  Going
+   faster than 1 the sinc is also a lowpass, so we don't alias. */
+#define VARISPEED_PERIOD 2
+#define VARISPEED_MAX 2 /* fastest speed, either direction */
+
+/* what next_speed() steps through */
+const float varispeeds[] = {1, 0.5, 2, -1, -0.5};
+#define N_VARISPEEDS (sizeof(varispeeds) / sizeof(varispeeds[0]))
+
+#define INTERP_LINEAR 0
+#define INTERP_SINC   1
+const char *interp_names[] = {"linear", "sinc"};
+
+/* settings that can be changed from outside while we're running.
+   Nobody changes them in place: a new copy is swapped in whole (see
+   control stuff), and process() reads whatever was latest when its
+   cycle started through cur_params, so it never has to lock. */
+struct params {
+  float track_gain[3]; /* how loud each track plays */
+  int interp[3];       /* how each track interpolates */
+};
+
+struct params default_params = {
+  {1.0/VOLUME_DECREASE, 1.0/VOLUME_DECREASE, 1.0/VOLUME_DECREASE},
+  {INTERP_SINC, INTERP_SINC, INTERP_SINC},
+};
+
+struct params *volatile params = &default_params; /* the latest */
+struct params *cur_params = &default_params;      /* this cycle's */
+
+/* which of varispeeds each track plays at, and how it interpolates.
+   speed_want is changed by gestures and commands, and both get acted
+   on at the top of the cycle. */
+int speed_want[3];
+int track_speed[3], track_interp[3] = {INTERP_SINC, INTERP_SINC, INTERP_SINC};
+
+/* SINC_TAPS is up in kernel stuff */
+#define SINC_PHASES 512
+
+/* taps for each fractional position, for cutoffs of 1 (speeds up to
+   1) and 1/VARISPEED_MAX (faster) */
+float sinc_table[2][SINC_PHASES + 1][SINC_TAPS];
+
+/* we interpolate this many output samples at a time, out of a window
+   of the track copied out of its ring */
+#define VS_BLOCK 256
+#define VS_WINDOW (VS_BLOCK*VARISPEED_MAX + SINC_TAPS + 2)
+jack_default_audio_sample_t vs_window[VS_WINDOW];
+jack_default_audio_sample_t vs_out[VS_BLOCK];
+
+/* blackman windowed sinc, each phase normalized to unity gain */
+void varispeed_init()
+{
+  for (int t = 0 ; t < 2 ; t++) {
+    double cutoff = t ? 1.0 / VARISPEED_MAX : 1.0;
+    for (int p = 0 ; p <= SINC_PHASES ; p++) {
+      double frac = (double)p / SINC_PHASES, sum = 0;
+      for (int j = 0 ; j < SINC_TAPS ; j++) {
+	double x = j - (SINC_TAPS/2 - 1) - frac;
+	double w = 0.42 + 0.5 * cos(M_PI * x / (SINC_TAPS/2)) +
+	  0.08 * cos(2 * M_PI * x / (SINC_TAPS/2));
+	double h = x == 0 ? cutoff : sin(M_PI * cutoff * x) / (M_PI * x);
+	if (fabs(x) >= SINC_TAPS/2) { w = 0; }
+	sinc_table[t][p][j] = h * w;
+	sum += h * w;
+      }
+      for (int j = 0 ; j < SINC_TAPS ; j++) { sinc_table[t][p][j] /= sum; }
+    }
+  }
+}
+
+int varispeed_on(int pedal)
+{
+  return varispeeds[track_speed[pedal]] != 1;
+}
+
+/* move on to the next speed, for a pedal to call */
+void next_speed(int pedal)
+{
+  speed_want[pedal] = (speed_want[pedal] + 1) % N_VARISPEEDS;
+}
+
+/* called at the top of each cycle */
+void varispeed_update()
+{
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    int interp = shed >= SHED_INTERP ? INTERP_LINEAR : cur_params->interp[pedal];
+    if (speed_want[pedal] != track_speed[pedal] ||
+	interp != track_interp[pedal]) {
+      track_speed[pedal] = speed_want[pedal];
+      track_interp[pedal] = interp;
+      printf("track %d at speed %g (%s)\n", pedal,
+	     varispeeds[track_speed[pedal]], interp_names[track_interp[pedal]]);
+    }
+  }
+}
+
+/* out[0, n) = the track read at speed from position x (which is in
+   track samples), n no more than VS_BLOCK */
+void varispeed_block(struct ring track, double x, float speed, int interp,
+		     jack_default_audio_sample_t *out, int n)
+{
+  double last = x + speed * (n - 1);
+  int lo = floor(x < last ? x : last) - (SINC_TAPS/2 - 1);
+  int len = ceil(fabs(last - x)) + SINC_TAPS + 2;
+  double start = x - lo;
+
+  ring_read(track, lo, vs_window, len);
+
+  if (interp == INTERP_LINEAR) {
+    kern->linear(out, n, vs_window, start, speed);
+  }
+  else {
+    kern->sinc(out, n, vs_window, start, speed,
+	       sinc_table[fabsf(speed) > 1], SINC_PHASES);
+  }
+}
+
+/* out[0, n) = what this track plays at pos on the loop grid */
+void read_track(int pedal, struct ring track, int pos,
+		jack_default_audio_sample_t *out, int n)
+{
+  float speed = varispeeds[track_speed[pedal]];
+
+  if (speed == 1) {
+    ring_read(track, pos, out, n);
+    return;
+  }
+
+  long long grid = (heads[pedal].loop % VARISPEED_PERIOD) * track.len + pos;
+  for (int base = 0 ; base < n ; base += VS_BLOCK) {
+    int len = n - base < VS_BLOCK ? n - base : VS_BLOCK;
+    double x = fmod(speed * (double)(grid + base), track.len);
+    if (x < 0) { x += track.len; }
+    varispeed_block(track, x, speed, track_interp[pedal], out + base, len);
+  }
+}
+
+/* like play_track(), but for a track that isn't at normal speed */
+void play_varispeed(int pedal, struct ring track, int pos,
+		    jack_default_audio_sample_t *out,
+		    jack_default_audio_sample_t *track_out, int nframes, float gain)
+{
+  for (int base = 0 ; base < nframes ; base += VS_BLOCK) {
+    int n = nframes - base < VS_BLOCK ? nframes - base : VS_BLOCK;
+
+    read_track(pedal, track, pos + base, vs_out, n);
+    for (int i = 0 ; i < n ; i++) {
+      float y = vs_out[i] * gain;
+      if (track_out) { track_out[base + i] = y; }
+      out[base + i] += y;
+    }
+  }
+}
+
+/* time each way of reading a track, so we know what they cost */
+#define VS_CALIBRATE_BLOCKS 200
+void varispeed_calibrate()
+{
+  struct ring track = {loop_bufs, SAMPLE_RATE};
+
+  for (int interp = INTERP_LINEAR ; interp <= INTERP_SINC ; interp++) {
+    for (int s = 0 ; s < N_VARISPEEDS ; s++) {
+      if (varispeeds[s] == 1) { continue; }
+
+      long long start = now_ns();
+      for (int b = 0 ; b < VS_CALIBRATE_BLOCKS ; b++) {
+	varispeed_block(track, b * 1000.5, varispeeds[s], interp, vs_out, VS_BLOCK);
+      }
+      printf("varispeed %g %s: about %.1f ns/sample\n", varispeeds[s],
+	     interp_names[interp],
+	     (double)(now_ns() - start) / (VS_CALIBRATE_BLOCKS * VS_BLOCK));
+    }
+  }
+}
+
+/*** loudness stuff ***/
+
+/* Every take comes in at whatever level it was played at.  While a
+   track records we measure how loud it is as we go, so that when it
+   starts playing we can set its level right away without going back
+   over the buffer.  The measurement is the BS.1770 one: K-weighted
+   (a high shelf and a high pass; the coefficients are for 48k), mean
+   square over 400ms blocks, ignoring blocks quieter than -70 LUFS so
+   silence at either end doesn't count.  It's a couple of biquads per
+   recorded sample.
+
+   The level we pick multiplies whatever gain the control plane sets.
+   Set AUTO_GAIN to 0 to play tracks back the way they came in. */
+#define AUTO_GAIN 1
+#define TARGET_LUFS -20.0
+#define MAX_AUTO_GAIN_DB 12.0
+#define AUTO_GAIN_CEILING 0.9 /* don't push a track's peak past this */
+#define LOUDNESS_BLOCK (SAMPLE_RATE*4/10)
+#define LOUDNESS_GATE 1.1724e-7 /* mean square of a -70 LUFS block */
+
+struct loudness {
+  float z[2][2];    /* the two k-weighting biquads' state */
+  double block_sum; /* the 400ms block we're in */
+  int block_n;
+  double gated_sum; /* every block that was loud enough */
+  long long gated_n;
+  float peak;
+};
+
+struct loudness loudness[3];
+
+/* engine owned; what the track's gain gets multiplied by */
+float auto_gain[3] = {1, 1, 1};
+
+/* stage one is the shelf, stage two the high pass */
+const float kweight_b[2][3] = {
+  {1.53512485958697, -2.69169618940638, 1.19839281085285},
+  {1.0, -2.0, 1.0},
+};
+const float kweight_a[2][2] = {
+  {-1.69065929318241, 0.73248077421585},
+  {-1.99004745483398, 0.99007225036621},
+};
+
+void loudness_start(int pedal)
+{
+  memset(&loudness[pedal], 0, sizeof(loudness[pedal]));
+}
+
+/* measure some audio just written to the track */
+void loudness_measure(int pedal, jack_default_audio_sample_t *buf, int n)
+{
+  struct loudness *l = &loudness[pedal];
+
+  while (n > 0) {
+    int len = LOUDNESS_BLOCK - l->block_n;
+    if (len > n) { len = n; }
+
+    double sum = 0;
+    float peak = l->peak;
+    for (int i = 0 ; i < len ; i++) {
+      float x = buf[i];
+      if (fabsf(x) > peak) { peak = fabsf(x); }
+      for (int s = 0 ; s < 2 ; s++) {
+	/* transposed direct form II */
+	float y = kweight_b[s][0] * x + l->z[s][0];
+	l->z[s][0] = kweight_b[s][1] * x - kweight_a[s][0] * y + l->z[s][1];
+	l->z[s][1] = kweight_b[s][2] * x - kweight_a[s][1] * y;
+	x = y;
+      }
+      sum += x * x;
+    }
+    l->peak = peak;
+    l->block_sum += sum;
+    l->block_n += len;
+    buf += len;
+    n -= len;
+
+    if (l->block_n == LOUDNESS_BLOCK) {
+      if (l->block_sum > LOUDNESS_GATE * LOUDNESS_BLOCK) {
+	l->gated_sum += l->block_sum;
+	l->gated_n += l->block_n;
+      }
+      l->block_sum = 0;
+      l->block_n = 0;
+    }
+  }
+}
+
+/* the track has stopped recording: set its level from what we heard */
+void loudness_finish(int pedal)
+{
+  struct loudness *l = &loudness[pedal];
+
+  /* whatever's left over counts if it's loud enough */
+  if (l->block_n && l->block_sum > LOUDNESS_GATE * l->block_n) {
+    l->gated_sum += l->block_sum;
+    l->gated_n += l->block_n;
+  }
+  if (!AUTO_GAIN || !l->gated_n) {
+    auto_gain[pedal] = 1;
+    return;
+  }
+
+  double lufs = -0.691 + 10 * log10(l->gated_sum / l->gated_n);
+  double gain_db = TARGET_LUFS - lufs;
+  if (gain_db > MAX_AUTO_GAIN_DB) { gain_db = MAX_AUTO_GAIN_DB; }
+  float gain = pow(10, gain_db / 20);
+  if (l->peak * gain > AUTO_GAIN_CEILING) { gain = AUTO_GAIN_CEILING / l->peak; }
+  auto_gain[pedal] = gain;
+  printf ("track %d came in at %.1f LUFS, peak %.2f: gain %.2f\n",
+	  pedal, lufs, l->peak, gain);
+}
+
+/* what a track's samples get multiplied by on the way out */
+float track_level(int pedal)
+{
+  return cur_params->track_gain[pedal] * auto_gain[pedal];
+}
+
+/*** peak stuff ***/
+
+/* For drawing the loops: a min/max pyramid per track, kept up to date
+   as we record, so an overview of a whole loop costs a few bucket
+   lookups per pixel instead of a pass over millions of samples.
+   Level 0 has a bucket per PEAK_BUCKET samples and each level up is
+   PEAK_FANOUT times coarser.  A bucket is a byte each of min and max,
+   which is plenty for drawing.
+
+   Only the engine writes buckets.  Readers don't lock: they can catch
+   a bucket half updated, which at worst draws one pixel a bit wrong
+   until next time.  gen goes up when a track starts a new take, so a
+   reader knows to throw away what it had. */
+#define PEAK_BUCKET_SHIFT 8 /* 256 samples */
+#define PEAK_FANOUT_SHIFT 2 /* 4 buckets to one */
+#define PEAK_LEVELS 5
+#define PEAK_SHIFT(level) (PEAK_BUCKET_SHIFT + (level) * PEAK_FANOUT_SHIFT)
+#define PEAK_BUCKETS(level) ((AMT_MEM >> PEAK_SHIFT(level)) + 1)
+
+struct peak {
+  signed char min, max; /* min > max means nothing's been written */
+};
+
+struct peaks {
+  struct peak *level[PEAK_LEVELS];
+  volatile unsigned gen;
+};
+
+struct peaks track_peaks[3];
+
+void peaks_init()
+{
+  int per_track = 0;
+  for (int level = 0 ; level < PEAK_LEVELS ; level++) {
+    per_track += PEAK_BUCKETS(level);
+  }
+  struct peak *mem = alloc_locked_mem(3 * per_track * sizeof(struct peak));
+
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    for (int level = 0 ; level < PEAK_LEVELS ; level++) {
+      track_peaks[pedal].level[level] = mem;
+      mem += PEAK_BUCKETS(level);
+    }
+  }
+}
+
+/* a new take: empty every bucket */
+void peaks_start(int pedal)
+{
+  struct peaks *p = &track_peaks[pedal];
+
+  for (int level = 0 ; level < PEAK_LEVELS ; level++) {
+    for (int b = 0 ; b < PEAK_BUCKETS(level) ; b++) {
+      p->level[level][b].min = 127;
+      p->level[level][b].max = -128;
+    }
+  }
+  p->gen++;
+}
+
+/* a sample already scaled by 127, as a bucket value */
+signed char peak_clamp(float x)
+{
+  if (x > 127) { return 127; }
+  if (x < -127) { return -127; }
+  return x;
+}
+
+/* buf was just written to the track at pos, wrapping at len */
+void peaks_write(int pedal, int pos, int len,
+		 jack_default_audio_sample_t *buf, int n)
+{
+  struct peaks *p = &track_peaks[pedal];
+
+  while (n > 0) {
+    /* up to the end of this level 0 bucket, or the track */
+    int end = ((pos >> PEAK_BUCKET_SHIFT) + 1) << PEAK_BUCKET_SHIFT;
+    if (end > len) { end = len; }
+    int k = end - pos < n ? end - pos : n;
+
+    float lo, hi;
+    kern->range(buf, k, &lo, &hi);
+    /* round outwards so a quiet track still shows */
+    signed char qlo = peak_clamp(floorf(lo * 127));
+    signed char qhi = peak_clamp(ceilf(hi * 127));
+
+    for (int level = 0 ; level < PEAK_LEVELS ; level++) {
+      struct peak *b = &p->level[level][pos >> PEAK_SHIFT(level)];
+      if (qlo < b->min) { b->min = qlo; }
+      if (qhi > b->max) { b->max = qhi; }
+    }
+
+    buf += k;
+    n -= k;
+    pos += k;
+    if (pos == len) { pos = 0; }
+  }
+}
+
+/* fill out[0, width) with the min and max of each pixel's share of the
+   first len samples of a track.  Uses the coarsest level that still
+   has a few buckets per pixel (so pixel edges don't smear much), so
+   each pixel looks at no more than 16. */
+void peaks_overview(int pedal, int len, int width, struct peak *out)
+{
+  struct peaks *p = &track_peaks[pedal];
+  int level = 0;
+
+  while (level + 1 < PEAK_LEVELS &&
+	 (4 << PEAK_SHIFT(level + 1)) <= len / width) {
+    level++;
+  }
+  for (int x = 0 ; x < width ; x++) {
+    int first = ((long long)x * len / width) >> PEAK_SHIFT(level);
+    int last = (((long long)(x + 1) * len / width) - 1) >> PEAK_SHIFT(level);
+    struct peak px = {127, -128};
+
+    for (int b = first ; b <= last && b < PEAK_BUCKETS(level) ; b++) {
+      struct peak bucket = p->level[level][b];
+      if (bucket.min < px.min) { px.min = bucket.min; }
+      if (bucket.max > px.max) { px.max = bucket.max; }
+    }
+    if (px.min > px.max) { px.min = px.max = 0; }
+    out[x] = px;
+  }
+}
+
+/*** silence stuff ***/
+
+/* Plenty of tracks are mostly rests: stabs, bass hits.  We keep a map
+   of which SILENT_BLOCK sample blocks of each track never got above
+   SILENCE_THRESHOLD while recording, and playing at normal speed skips
+   those blocks instead of mixing in near zeros.
+
+   The blocks are still there in loop_bufs: everything is allocated and
+   locked up front so recording can't page fault, and the effects and
+   varispeed read the track directly. */
+#define SILENT_SHIFT 8 /* 256 samples */
+#define SILENT_BLOCKS ((AMT_MEM >> SILENT_SHIFT) + 1)
+#define SILENCE_THRESHOLD 0.0001 /* -80dB */
+
+unsigned char track_silent[3][SILENT_BLOCKS];
+
+void silence_start(int pedal)
+{
+  memset(track_silent[pedal], 1, SILENT_BLOCKS);
+}
+
+/* buf was just written to the track at pos, wrapping at len */
+void silence_write(int pedal, int pos, int len,
+		   jack_default_audio_sample_t *buf, int n)
+{
+  while (n > 0) {
+    int end = ((pos >> SILENT_SHIFT) + 1) << SILENT_SHIFT;
+    if (end > len) { end = len; }
+    int k = end - pos < n ? end - pos : n;
+
+    unsigned char *silent = &track_silent[pedal][pos >> SILENT_SHIFT];
+    if (*silent) {
+      float lo, hi;
+      kern->range(buf, k, &lo, &hi);
+      if (-lo > SILENCE_THRESHOLD || hi > SILENCE_THRESHOLD) { *silent = 0; }
+    }
+
+    buf += k;
+    n -= k;
+    pos += k;
+    if (pos == len) { pos = 0; }
+  }
+}
+
+/* like play_track(), but skipping silent blocks */
+void play_sparse(int pedal, struct ring track, int pos,
+		 jack_default_audio_sample_t *out,
+		 jack_default_audio_sample_t *track_out, int nframes, float gain)
+{
+  unsigned char *silent = track_silent[pedal];
+
+  for (int done = 0 ; done < nframes ; ) {
+    /* a run of blocks that are all silent or all not */
+    int start = (pos + done) % track.len;
+    int quiet = silent[start >> SILENT_SHIFT];
+    int n = 0;
+    while (done + n < nframes) {
+      int p = (start + n) % track.len;
+      if (silent[p >> SILENT_SHIFT] != quiet) { break; }
+      int end = ((p >> SILENT_SHIFT) + 1) << SILENT_SHIFT;
+      n += (end < track.len ? end : track.len) - p;
+    }
+    if (done + n > nframes) { n = nframes - done; }
+
+    if (!quiet) {
+      play_track(track, start, out + done, track_out ? track_out + done : NULL,
+		 n, gain);
+    }
+    else if (track_out) {
+      memset(track_out + done, 0, n * sizeof(jack_default_audio_sample_t));
+    }
+    done += n;
+  }
+}
+
+/* everything that watches a take as it's recorded */
+void take_start(int pedal)
+{
+  loudness_start(pedal);
+  peaks_start(pedal);
+  silence_start(pedal);
+}
+
+void take_write(int pedal, int pos, int len,
+		jack_default_audio_sample_t *buf, int n)
+{
+  loudness_measure(pedal, buf, n);
+  peaks_write(pedal, pos, len, buf, n);
+  silence_write(pedal, pos, len, buf, n);
+}
+
+/*** effects stuff ***/
+
+/* each track has a short chain of insert effects that run on its
+   playback.  They work a block at a time out of fx_scratch and all of
+   their state, including delay lines, is allocated before we go
+   realtime.  Turning one on goes through process() so we can check
+   first that we have the time to run it. */
+
+#define FX_NONE     0
+#define FX_EQ       1 /* peaking eq: freq, gain_db, q */
+#define FX_COMP     2 /* compressor: threshold_db, ratio, attack_ms, release_ms */
+#define FX_FILTER   3 /* lowpass: freq, q */
+#define FX_DELAY    4 /* echo: time_ms, feedback, mix */
+#define FX_REVERB   5 /* schroeder reverb: size (0-1), mix */
+
+const char *fx_names[] = {"none", "eq", "comp", "filter", "delay", "reverb"};
+
+/* slots per track */
+#define MAX_FX 4
+
+/* effects process at most this many samples at a time */
+#define FX_BLOCK 256
+
+/* longest delay line (and reverb storage) per effect */
+#define FX_LINE_LEN (SAMPLE_RATE*2)
+
+/* an effect starting up in process() clears this much of its line a
+   cycle, rather than all of it at once */
+#define FX_CLEAR_STEP 16384
+
+/* refuse to turn on an effect if that would make our cycles take more
+   than this percent of the time we have for them */
+#define FX_BUDGET_PERCENT 70
+
+/* print what the running effects cost this often */
+#define FX_REPORT_SECONDS 10
+
+struct effect {
+  int type;
+  volatile int want_on; /* set by anyone, acted on by process() */
+  int on;               /* only process() changes this */
+
+  /* parameters, which ones matter depends on type */
+  float freq, q, gain_db;
+  float threshold_db, ratio, attack_ms, release_ms;
+  float time_ms, feedback, mix, size;
+
+  /* biquad (eq and filter) */
+  float b0, b1, b2, a1, a2, z1, z2;
+
+  /* compressor */
+  float env, gain, thresh, att, rel;
+
+  /* delay line, shared out between the combs and allpasses for reverb */
+  jack_default_audio_sample_t *line;
+  int delay_len, delay_pos;
+  int comb_start[4], comb_len[4], comb_pos[4];
+  float comb_z[4];
+  int ap_start[2], ap_len[2], ap_pos[2];
+  int line_used;  /* how much of line it actually reads */
+  int clear_pos;  /* line[0, clear_pos) is clear; it waits until that's line_used */
+
+  /* what this costs: estimated before it's turned on, measured after */
+  double est_ns_per_sample;
+  double cost_ns; /* moving average of time spent per cycle */
+};
+
+struct effect effects[3][MAX_FX];
+
+jack_default_audio_sample_t fx_scratch[FX_BLOCK];
+
+/* the chains we start with.  Everything listed here is set up and
+   costed at startup; entries with on set are turned on once we're
+   running. */
+struct fx_setup {
+  int track, slot, type, on;
+  float a, b, c, d; /* the parameters, in the order listed by type above */
+} fx_setups[] = {
+  {0, 0, FX_EQ,     0,  250, -3, 0.7, 0},
+  {0, 1, FX_COMP,   0,  -18, 4, 5, 100},
+  {1, 0, FX_FILTER, 0,  4000, 0.7, 0, 0},
+  {1, 1, FX_DELAY,  0,  375, 0.35, 0.3, 0},
+  {2, 0, FX_REVERB, 0,  0.6, 0.25, 0, 0},
+};
+
+/* standard "audio eq cookbook" biquads */
+
+void fx_biquad_coeffs(struct effect *fx)
+{
+  float w0 = 2 * M_PI * fx->freq / SAMPLE_RATE;
+  float alpha = sinf(w0) / (2 * fx->q);
+  float cw = cosf(w0);
+  float a0;
+
+  if (fx->type == FX_EQ) {
+    float A = powf(10, fx->gain_db / 40);
+    fx->b0 = 1 + alpha * A;
+    fx->b1 = -2 * cw;
+    fx->b2 = 1 - alpha * A;
+    a0 = 1 + alpha / A;
+    fx->a1 = -2 * cw;
+    fx->a2 = 1 - alpha / A;
+  }
+  else {
+    fx->b0 = (1 - cw) / 2;
+    fx->b1 = 1 - cw;
+    fx->b2 = (1 - cw) / 2;
+    a0 = 1 + alpha;
+    fx->a1 = -2 * cw;
+    fx->a2 = 1 - alpha;
+  }
+  fx->b0 /= a0; fx->b1 /= a0; fx->b2 /= a0;
+  fx->a1 /= a0; fx->a2 /= a0;
+}
+
+/* get the effect ready to start from silence.  The line can be
+   hundreds of KB, too much to clear in one cycle, so it's left for
+   fx_clear_some() to do a piece at a time; the effect doesn't run
+   until it's done. */
+void fx_start(struct effect *fx)
+{
+  fx->z1 = fx->z2 = 0;
+  fx->env = 0;
+  fx->gain = 1;
+  fx->delay_pos = 0;
+  for (int c = 0 ; c < 4 ; c++) { fx->comb_pos[c] = 0; fx->comb_z[c] = 0; }
+  for (int a = 0 ; a < 2 ; a++) { fx->ap_pos[a] = 0; }
+  fx->clear_pos = 0;
+}
+
+/* called once a cycle: clear the next piece of a starting effect's line */
+void fx_clear_some(struct effect *fx)
+{
+  int n = fx->line_used - fx->clear_pos;
+
+  if (n <= 0) { return; }
+  if (n > FX_CLEAR_STEP) { n = FX_CLEAR_STEP; }
+  memset(fx->line + fx->clear_pos, 0, n * sizeof(jack_default_audio_sample_t));
+  fx->clear_pos += n;
+}
+
+/* clear out any state so the effect starts from silence, all at once.
+   Not for process(). */
+void fx_reset(struct effect *fx)
+{
+  fx_start(fx);
+  if (fx->line) {
+    memset(fx->line, 0, FX_LINE_LEN * sizeof(jack_default_audio_sample_t));
+  }
+  fx->clear_pos = fx->line_used;
+}
+
+void fx_configure(struct fx_setup *setup)
+{
+  struct effect *fx = &effects[setup->track][setup->slot];
+
+  fx->type = setup->type;
+  switch (fx->type) {
+  case FX_EQ:
+    fx->freq = setup->a; fx->gain_db = setup->b; fx->q = setup->c;
+    fx_biquad_coeffs(fx);
+    break;
+  case FX_FILTER:
+    fx->freq = setup->a; fx->q = setup->b;
+    fx_biquad_coeffs(fx);
+    break;
+  case FX_COMP:
+    fx->threshold_db = setup->a; fx->ratio = setup->b;
+    fx->attack_ms = setup->c; fx->release_ms = setup->d;
+    fx->thresh = powf(10, fx->threshold_db / 20);
+    fx->att = expf(-1000.0 / (fx->attack_ms * SAMPLE_RATE));
+    fx->rel = expf(-1000.0 / (fx->release_ms * SAMPLE_RATE));
+    break;
+  case FX_DELAY:
+    fx->time_ms = setup->a; fx->feedback = setup->b; fx->mix = setup->c;
+    fx->delay_len = fx->time_ms * SAMPLE_RATE / 1000;
+    if (fx->delay_len < 1) { fx->delay_len = 1; }
+    if (fx->delay_len > FX_LINE_LEN) { fx->delay_len = FX_LINE_LEN; }
+    fx->line_used = fx->delay_len;
+    break;
+  case FX_REVERB: {
+    /* classic schroeder comb and allpass lengths, scaled by size */
+    const int combs[4] = {1557, 1617, 1491, 1422};
+    const int aps[2] = {225, 556};
+    int start = 0;
+
+    fx->size = setup->a; fx->mix = setup->b;
+    fx->feedback = 0.7 + 0.28 * fx->size;
+    for (int c = 0 ; c < 4 ; c++) {
+      fx->comb_start[c] = start;
+      fx->comb_len[c] = combs[c] * (0.5 + fx->size);
+      start += fx->comb_len[c];
+    }
+    for (int a = 0 ; a < 2 ; a++) {
+      fx->ap_start[a] = start;
+      fx->ap_len[a] = aps[a];
+      start += aps[a];
+    }
+    fx->line_used = start;
+    break;
+  }
+  }
+  if (fx->type == FX_DELAY || fx->type == FX_REVERB) {
+    if (!fx->line) { fx->line = alloc_audio_mem(FX_LINE_LEN); }
+  }
+  fx_reset(fx);
+}
+
+void fx_run_biquad(struct effect *fx, jack_default_audio_sample_t *buf, int n)
+{
+  float b0 = fx->b0, b1 = fx->b1, b2 = fx->b2, a1 = fx->a1, a2 = fx->a2;
+  float z1 = fx->z1, z2 = fx->z2;
+
+  for (int i = 0 ; i < n ; i++) {
+    float x = buf[i];
+    float y = b0 * x + z1;
+    z1 = b1 * x - a1 * y + z2;
+    z2 = b2 * x - a2 * y;
+    buf[i] = y;
+  }
+  fx->z1 = z1;
+  fx->z2 = z2;
+}
+
+/* the envelope follows every sample, but we only work out the gain
+   every COMP_STEP samples and ramp between, which keeps the powf()s
+   out of the inner loop */
+#define COMP_STEP 16
+void fx_run_comp(struct effect *fx, jack_default_audio_sample_t *buf, int n)
+{
+  float env = fx->env, gain = fx->gain;
+
+  for (int base = 0 ; base < n ; base += COMP_STEP) {
+    int len = n - base < COMP_STEP ? n - base : COMP_STEP;
+
+    for (int i = base ; i < base + len ; i++) {
+      float a = fabsf(buf[i]);
+      env = a + (a > env ? fx->att : fx->rel) * (env - a);
+    }
+    float target = env > fx->thresh ?
+      powf(env / fx->thresh, 1 / fx->ratio - 1) : 1;
+    float step = (target - gain) / len;
+    for (int i = 0 ; i < len ; i++) {
+      buf[base + i] *= gain + step * i;
+    }
+    gain = target;
+  }
+  fx->env = env;
+  fx->gain = gain;
+}
+
+void fx_run_delay(struct effect *fx, jack_default_audio_sample_t *buf, int n)
+{
+  jack_default_audio_sample_t *line = fx->line;
+  int pos = fx->delay_pos;
+
+  for (int i = 0 ; i < n ; i++) {
+    float d = line[pos];
+    line[pos] = buf[i] + fx->feedback * d;
+    buf[i] += fx->mix * d;
+    if (++pos == fx->delay_len) { pos = 0; }
+  }
+  fx->delay_pos = pos;
+}
+
+#define REVERB_DAMP 0.2
+void fx_run_reverb(struct effect *fx, jack_default_audio_sample_t *buf, int n)
+{
+  for (int i = 0 ; i < n ; i++) {
+    float x = buf[i] * 0.25;
+    float sum = 0;
+
+    for (int c = 0 ; c < 4 ; c++) {
+      jack_default_audio_sample_t *comb = fx->line + fx->comb_start[c];
+      float d = comb[fx->comb_pos[c]];
+      fx->comb_z[c] = d * (1 - REVERB_DAMP) + fx->comb_z[c] * REVERB_DAMP;
+      comb[fx->comb_pos[c]] = x + fx->feedback * fx->comb_z[c];
+      if (++fx->comb_pos[c] == fx->comb_len[c]) { fx->comb_pos[c] = 0; }
+      sum += d;
+    }
+    for (int a = 0 ; a < 2 ; a++) {
+      jack_default_audio_sample_t *ap = fx->line + fx->ap_start[a];
+      float d = ap[fx->ap_pos[a]];
+      ap[fx->ap_pos[a]] = sum + 0.5 * d;
+      sum = d - sum;
+      if (++fx->ap_pos[a] == fx->ap_len[a]) { fx->ap_pos[a] = 0; }
+    }
+    buf[i] += fx->mix * (sum - buf[i]);
+  }
+}
+
+void fx_run(struct effect *fx, jack_default_audio_sample_t *buf, int n)
+{
+  switch (fx->type) {
+  case FX_EQ:
+  case FX_FILTER: fx_run_biquad(fx, buf, n); break;
+  case FX_COMP:   fx_run_comp(fx, buf, n); break;
+  case FX_DELAY:  fx_run_delay(fx, buf, n); break;
+  case FX_REVERB: fx_run_reverb(fx, buf, n); break;
+  }
+}
+
+/* run every configured effect over some noise to see what it costs
+   per sample, so we have something to go on before it's turned on */
+#define FX_CALIBRATE_BLOCKS 200
+void fx_calibrate()
+{
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    for (int slot = 0 ; slot < MAX_FX ; slot++) {
+      struct effect *fx = &effects[pedal][slot];
+      if (fx->type == FX_NONE) { continue; }
+
+      long long spent = 0;
+      for (int b = 0 ; b < FX_CALIBRATE_BLOCKS ; b++) {
+	for (int i = 0 ; i < FX_BLOCK ; i++) {
+	  fx_scratch[i] = (rand() / (float)RAND_MAX - 0.5) / 4;
+	}
+	long long start = now_ns();
+	fx_run(fx, fx_scratch, FX_BLOCK);
+	spent += now_ns() - start;
+      }
+      fx->est_ns_per_sample = (double)spent /
+	(FX_CALIBRATE_BLOCKS * FX_BLOCK);
+      fx_reset(fx);
+      printf("fx %d.%d %s: about %.1f ns/sample\n", pedal, slot,
+	     fx_names[fx->type], fx->est_ns_per_sample);
+    }
+  }
+}
+
+/* called at the top of each cycle: act on any requests to turn
+   effects on or off.  An effect only gets turned on if our average
+   cycle plus what we think it costs fits in the budget. */
+void fx_update(jack_nframes_t nframes)
+{
+  double budget_ns = 1e9 * nframes / SAMPLE_RATE * FX_BUDGET_PERCENT / 100;
+
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    for (int slot = 0 ; slot < MAX_FX ; slot++) {
+      struct effect *fx = &effects[pedal][slot];
+
+      if (fx->want_on && !fx->on) {
+	double projected = cycle_ns + fx->est_ns_per_sample * nframes;
+	if (fx->type == FX_NONE || projected > budget_ns) {
+	  printf("refusing fx %d.%d %s: %.0fns projected, %.0fns budget\n",
+		 pedal, slot, fx_names[fx->type], projected, budget_ns);
+	  fx->want_on = 0;
+	}
+	else {
+	  printf("fx %d.%d %s on\n", pedal, slot, fx_names[fx->type]);
+	  fx_start(fx);
+	  fx->cost_ns = fx->est_ns_per_sample * nframes;
+	  fx->on = 1;
+	}
+      }
+      else if (!fx->want_on && fx->on) {
+	printf("fx %d.%d %s off\n", pedal, slot, fx_names[fx->type]);
+	fx->on = 0;
+      }
+      if (fx->on) { fx_clear_some(fx); }
+    }
+  }
+}
+
+/* effects we shed are left on, just not run */
+int fx_any_on(int pedal)
+{
+  if (shed >= SHED_FX) { return 0; }
+  for (int slot = 0 ; slot < MAX_FX ; slot++) {
+    if (effects[pedal][slot].on) { return 1; }
+  }
+  return 0;
+}
+
+/* effects coming back from being shed start from silence rather than
+   whatever they had when they stopped.  We only just got out of an
+   overload, so their lines are cleared over the next few cycles like
+   any effect starting up, not all in this one. */
+void fx_resume()
+{
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    for (int slot = 0 ; slot < MAX_FX ; slot++) {
+      if (effects[pedal][slot].on) { fx_start(&effects[pedal][slot]); }
+    }
+  }
+}
+
+/* play this track through its effects and into out */
+void play_with_effects(int pedal, jack_default_audio_sample_t *out,
+		       struct ring track, int pos, int nframes)
+{
+  long long spent[MAX_FX] = {0};
+
+  for (int base = 0 ; base < nframes ; base += FX_BLOCK) {
+    int n = nframes - base < FX_BLOCK ? nframes - base : FX_BLOCK;
+
+    read_track(pedal, track, pos + base, fx_scratch, n);
+    for (int i = 0 ; i < n ; i++) {
+      fx_scratch[i] *= track_level(pedal);
+    }
+    for (int slot = 0 ; slot < MAX_FX ; slot++) {
+      struct effect *fx = &effects[pedal][slot];
+      if (!fx->on || fx->clear_pos < fx->line_used) { continue; }
+
+      long long start = now_ns();
+      fx_run(fx, fx_scratch, n);
+      spent[slot] += now_ns() - start;
+    }
+    for (int i = 0 ; i < n ; i++) {
+      out[base + i] += fx_scratch[i];
+    }
+  }
+
+  for (int slot = 0 ; slot < MAX_FX ; slot++) {
+    struct effect *fx = &effects[pedal][slot];
+    if (fx->on) { fx->cost_ns += (spent[slot] - fx->cost_ns) / 64; }
+  }
+}
+
+void print_fx_costs()
+{
+  int any = 0;
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    for (int slot = 0 ; slot < MAX_FX ; slot++) {
+      struct effect *fx = &effects[pedal][slot];
+      if (fx->on) {
+	printf("fx %d.%d %s: %.0f ns/cycle\n", pedal, slot,
+	       fx_names[fx->type], fx->cost_ns);
+	any = 1;
+      }
+    }
+  }
+  if (any) { printf("cycle: %.0f ns\n", cycle_ns); }
+}
+
+/*** sync stuff ***/
+
+/* Several loopers (one per laptop on stage, say) can share one loop.
+   One runs as the leader and every SYNC_INTERVAL_MS multicasts its
+   loop length and when its loop last started.  Each follower works
+   out how far its clock is from the leader's, and how fast that's
+   changing, by timestamping a round trip the way PTP does.  It then
+   steers its own loop onto the leader's by nudging loop_pos a few
+   samples at a time.
+
+   Followers bind SYNC_PORT with SO_REUSEADDR and answer on their own
+   sockets, so several instances on one machine work over loopback. */
+
+#define SYNC_NONE     0
+#define SYNC_LEADER   1
+#define SYNC_FOLLOWER 2
+int sync_mode = SYNC_NONE;
+
+#define SYNC_GROUP "239.255.76.76"
+#define SYNC_PORT 9876
+#define SYNC_INTERVAL_MS 100
+
+/* stop following if we haven't heard from the leader in this long */
+#define SYNC_TIMEOUT_US 2000000
+
+/* how much each new measurement moves our offset and drift estimates */
+#define SYNC_SMOOTHING 0.1
+
+/* the most we'll move loop_pos in one cycle, and how far off we can
+   be before we bother, in samples */
+#define SYNC_MAX_NUDGE 8
+#define SYNC_DEADBAND 16
+
+/* which local address to multicast on.  Use 127.0.0.1 to test with
+   several instances on one machine. */
+const char *sync_iface = "0.0.0.0";
+
+/* a loop as one thread sees it, for another thread to read */
+struct loop_clock {
+  int running;
+  int loop_end;
+  jack_time_t loop_top; /* when loop_pos was last 0, in usecs */
+  double period;        /* how long a loop lasts, in our usecs */
+  jack_time_t heard;    /* when we last heard from the leader */
+};
+
+/* the writer bumps seq before and after writing, so readers can tell
+   if they saw a torn update (seq odd or changed) and try again */
+struct shared_clock {
+  volatile unsigned seq;
+  struct loop_clock clock;
+};
+
+/* leader: process() publishes this and the network thread sends it */
+struct shared_clock our_clock;
+
+/* follower: the network thread publishes the leader's loop, already
+   converted to our clock, and process() steers towards it */
+struct shared_clock leader_clock;
+
+/* follower: process()'s last untorn copy of leader_clock */
+struct loop_clock leader_seen;
+
+/* follower: set by process() while there's a running leader to follow */
+int following = 0;
+
+void publish_clock(struct shared_clock *shared, struct loop_clock *clock)
+{
+  shared->seq++;
+  __sync_synchronize();
+  shared->clock = *clock;
+  __sync_synchronize();
+  shared->seq++;
+}
+
+void read_clock(struct shared_clock *shared, struct loop_clock *clock)
+{
+  unsigned seq;
+  do {
+    seq = shared->seq;
+    __sync_synchronize();
+    *clock = shared->clock;
+    __sync_synchronize();
+  } while ((seq & 1) || seq != shared->seq);
+}
+
+/* read_clock() for process(), which mustn't spin waiting on another
+   thread: one try, and if it was torn leave clock as it was */
+void try_read_clock(struct shared_clock *shared, struct loop_clock *clock)
+{
+  struct loop_clock copy;
+  unsigned seq = shared->seq;
+
+  __sync_synchronize();
+  copy = shared->clock;
+  __sync_synchronize();
+  if (!(seq & 1) && seq == shared->seq) { *clock = copy; }
+}
+
+int sync_socket()
+{
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct in_addr iface;
+  unsigned char ttl = 1;
+
+  if (sock == -1) {
+    perror("sync socket");
+    exit(1);
+  }
+  inet_aton(sync_iface, &iface);
+  setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface));
+  setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  return sock;
+}
+
+/* the leader: send our loop out every SYNC_INTERVAL_MS, and answer
+   delay requests as soon as they come in */
+void *sync_leader(void *arg)
+{
+  int sock = sync_socket();
+  struct sockaddr_in group = {0};
+  struct pollfd pfd = {sock, POLLIN, 0};
+  jack_time_t last_sent = 0;
+  unsigned seq = 0;
+  char msg[256];
+
+  group.sin_family = AF_INET;
+  group.sin_port = htons(SYNC_PORT);
+  inet_aton(SYNC_GROUP, &group.sin_addr);
+  TRACE_THREAD("sync leader");
+
+  while (1) {
+    if (poll(&pfd, 1, SYNC_INTERVAL_MS) > 0) {
+      TRACE_BEGIN(t_reply);
+      struct sockaddr_in from;
+      socklen_t from_len = sizeof(from);
+      int len = recvfrom(sock, msg, sizeof(msg) - 1, 0,
+			 (struct sockaddr *)&from, &from_len);
+      jack_time_t t4 = jack_get_time();
+      unsigned req_seq;
+      unsigned long long t3;
+
+      if (len > 0) {
+	msg[len] = '\0';
+	if (sscanf(msg, "dreq %u %llu", &req_seq, &t3) == 2) {
+	  len = snprintf(msg, sizeof(msg), "dresp %u %llu %llu",
+			 req_seq, t3, (unsigned long long)t4);
+	  sendto(sock, msg, len, 0, (struct sockaddr *)&from, from_len);
+	}
+      }
+      TRACE_END(t_reply, "sync reply");
+    }
+
+    jack_time_t t1 = jack_get_time();
+    if (t1 - last_sent >= SYNC_INTERVAL_MS * 1000) {
+      TRACE_BEGIN(t_send);
+      struct loop_clock clock;
+      read_clock(&our_clock, &clock);
+      int len = snprintf(msg, sizeof(msg), "sync %u %llu %d %d %llu",
+			 ++seq, (unsigned long long)t1, clock.running,
+			 clock.loop_end, (unsigned long long)clock.loop_top);
+      sendto(sock, msg, len, 0, (struct sockaddr *)&group, sizeof(group));
+      last_sent = t1;
+      TRACE_END(t_send, "sync send");
+    }
+  }
+  return NULL;
+}
+
+/* a follower: for every sync we get we send a delay request back to
+   the leader.  With t1 (leader sent sync), t2 (we got it), t3 (we
+   sent the request) and t4 (leader got it):
+
+     offset = ((t2 - t1) - (t4 - t3)) / 2   (our clock minus theirs)
+
+   assuming the trip takes as long each way.  We track the offset and
+   how fast it's drifting, and publish the leader's loop in our time. */
+void *sync_follower(void *arg)
+{
+  int group_sock = sync_socket();
+  int req_sock = sync_socket();
+  struct sockaddr_in addr = {0};
+  struct ip_mreq mreq;
+  int yes = 1;
+  struct pollfd pfds[2] = {{group_sock, POLLIN, 0}, {req_sock, POLLIN, 0}};
+  char msg[256];
+
+  /* the last sync we got */
+  struct sockaddr_in leader;
+  socklen_t leader_len = 0;
+  unsigned sync_seq = 0;
+  unsigned long long t1 = 0, t2 = 0, leader_top = 0;
+  int running = 0, leader_end = 0;
+
+  /* our estimates: offset (usecs) as of offset_at, and its drift */
+  double offset = 0, drift = 0;
+  jack_time_t offset_at = 0;
+  int have_offset = 0;
+
+  setsockopt(group_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(SYNC_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(group_sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    perror("sync bind");
+    exit(1);
+  }
+  inet_aton(SYNC_GROUP, &mreq.imr_multiaddr);
+  inet_aton(sync_iface, &mreq.imr_interface);
+  if (setsockopt(group_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		 &mreq, sizeof(mreq))) {
+    perror("sync join");
+    exit(1);
+  }
+
+  TRACE_THREAD("sync follower");
+
+  while (1) {
+    if (poll(pfds, 2, -1) <= 0) { continue; }
+    TRACE_BEGIN(t_follow);
+
+    if (pfds[0].revents & POLLIN) {
+      struct sockaddr_in from;
+      socklen_t from_len = sizeof(from);
+      int len = recvfrom(group_sock, msg, sizeof(msg) - 1, 0,
+			 (struct sockaddr *)&from, &from_len);
+      jack_time_t now = jack_get_time();
+
+      if (len > 0) {
+	unsigned seq;
+	unsigned long long sent, top;
+	int run, end;
+
+	msg[len] = '\0';
+	/* anyone on the group can send us this, so a loop we couldn't
+	   hold gets ignored before it reaches loop_end */
+	if (sscanf(msg, "sync %u %llu %d %d %llu", &seq, &sent,
+		   &run, &end, &top) == 5 && end > 0 && end <= AMT_MEM) {
+	  sync_seq = seq;
+	  t1 = sent;
+	  running = run;
+	  leader_end = end;
+	  leader_top = top;
+	  t2 = now;
+	  leader = from;
+	  leader_len = from_len;
+	  len = snprintf(msg, sizeof(msg), "dreq %u %llu", sync_seq,
+			 (unsigned long long)jack_get_time());
+	  sendto(req_sock, msg, len, 0, (struct sockaddr *)&leader, leader_len);
+	}
+      }
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      int len = recv(req_sock, msg, sizeof(msg) - 1, 0);
+      unsigned resp_seq;
+      unsigned long long t3, t4;
+
+      if (len > 0) {
+	msg[len] = '\0';
+	if (sscanf(msg, "dresp %u %llu %llu", &resp_seq, &t3, &t4) == 3 &&
+	    resp_seq == sync_seq) {
+	  double measured = (((double)t2 - t1) - ((double)t4 - t3)) / 2;
+
+	  if (!have_offset) {
+	    offset = measured;
+	    drift = 0;
+	    have_offset = 1;
+	  }
+	  else {
+	    double dt = (double)t2 - offset_at;
+	    double predicted = offset + drift * dt;
+	    double err = measured - predicted;
+	    offset = predicted + SYNC_SMOOTHING * err;
+	    if (dt > 0) { drift += SYNC_SMOOTHING * err / dt; }
+	  }
+	  offset_at = t2;
+
+	  struct loop_clock clock;
+	  clock.running = running;
+	  clock.loop_end = leader_end;
+	  clock.loop_top = leader_top + offset;
+	  clock.period = leader_end * 1e6 / SAMPLE_RATE * (1 + drift);
+	  clock.heard = t2;
+	  publish_clock(&leader_clock, &clock);
+	}
+      }
+    }
+    TRACE_END(t_follow, "sync follow");
+  }
+  return NULL;
+}
+
+/* follower, called from process(): line up with the leader's loop.
+   While we're off we just jump to wherever the leader is.  While we're
+   playing we return how many samples to move loop_pos by: forward if
+   we're behind the leader, back if we're ahead.  We leave the area
+   around the loop top alone so we never cross it twice. */
+int follow_leader(jack_nframes_t nframes, jack_time_t now)
+{
+  try_read_clock(&leader_clock, &leader_seen);
+  struct loop_clock clock = leader_seen;
+
+  following = clock.running && clock.period > 0 &&
+    now - clock.heard < SYNC_TIMEOUT_US;
+  if (!following) { return 0; }
+
+  double phase = fmod((double)now - clock.loop_top, clock.period);
+  if (phase < 0) { phase += clock.period; }
+
+  if (state == STATE_OFF) {
+    loop_end = clock.loop_end;
+    loop_pos = phase / clock.period * loop_end;
+    return 0;
+  }
+
+  int err = phase / clock.period * loop_end - loop_pos;
+  if (err > loop_end / 2) { err -= loop_end; }
+  if (err < -loop_end / 2) { err += loop_end; }
+
+  if (err <= SYNC_DEADBAND && err >= -SYNC_DEADBAND) { return 0; }
+  if (loop_pos < SYNC_MAX_NUDGE ||
+      loop_pos + nframes + SYNC_MAX_NUDGE >= loop_end) { return 0; }
+
+  if (err > SYNC_MAX_NUDGE) { err = SYNC_MAX_NUDGE; }
+  if (err < -SYNC_MAX_NUDGE) { err = -SYNC_MAX_NUDGE; }
+  return err;
+}
+
+void start_sync(int mode)
+{
+  pthread_t thread;
+
+  sync_mode = mode;
+  if (pthread_create(&thread, NULL,
+		     mode == SYNC_LEADER ? sync_leader : sync_follower, NULL)) {
+    fprintf(stderr, "cannot start sync thread\n");
+    exit(1);
+  }
+}
+
+/*** flight recorder stuff ***/
+
+/* When something goes wrong on stage we want to be able to see it
+   happen again.  The flight recorder keeps the last FLIGHT_SECONDS of
+   everything that goes into the engine: the raw input, and for each
+   cycle its length, the pedal press, where following the leader put
+   us, which effects were wanted, and a hash of what came out.  Every
+   FLIGHT_KEY_SECONDS process() also saves a keyframe of the engine's
+   state, and the main thread keeps a copy of the loop buffers as they
+   were at the oldest keyframe we still need, by replaying the
+   recordings that happened since onto it as they age out.
+
+   SIGUSR2 writes all this to FLIGHT_FILE, and `looper_sync replay'
+   runs it back through the engine offline, checking each cycle's
+   output against the hash.  Everything is preallocated; process()
+   only ever copies into rings.
+
+   Effect delay lines aren't in the keyframes (they're big), so a
+   delay or reverb that's running at the start of the dump replays
+   from silence and its tail won't match for a while. */
+#define FLIGHT_SECONDS 120
+#define FLIGHT_KEY_SECONDS 10
+
+/* the rings cover the window, plus up to two keyframes of waiting
+   for the main thread to catch up, plus some slack */
+#define FLIGHT_RING_SECONDS (FLIGHT_SECONDS + 3*FLIGHT_KEY_SECONDS)
+#define FLIGHT_INPUT_LEN (FLIGHT_RING_SECONDS*SAMPLE_RATE + HISTORY_LEN)
+
+/* we keep a record per cycle, so size for the shortest period we
+   expect jack to run with */
+#define FLIGHT_MIN_NFRAMES 32
+#define FLIGHT_CYCLES (FLIGHT_RING_SECONDS*SAMPLE_RATE/FLIGHT_MIN_NFRAMES)
+#define FLIGHT_KEYS (FLIGHT_RING_SECONDS/FLIGHT_KEY_SECONDS + 2)
+
+#define FLIGHT_FILE "looper_flight.bin"
+#define REPLAY_FILE "looper_replay.raw" /* 32 bit float, mono */
+
+struct flight_cycle {
+  long long frame;        /* input frame this cycle starts at */
+  int nframes;
+  struct cycle_input input;
+  struct params params;
+  int loop_pos, loop_end; /* after following the leader */
+  int following;
+  unsigned fx_want;       /* a bit per effect slot */
+  double cycle_ns;
+
+  /* what got recorded into the loop buffers, so the main thread can
+     do the same to its copy */
+  int late_pedal, late_len; /* record_from_history() */
+  int rec_mask, rec_pos[3], rec_len[3];
+  int rec_off[3], rec_n[3]; /* which part of the block */
+
+  int hashed;             /* unless we were shedding load */
+  unsigned out_hash;
+};
+
+/* everything process() changes that isn't in a loop buffer or
+   derived from the recorded input */
+struct flight_key {
+  long long cycle; /* taken just before this cycle ran */
+  long long frame;
+  int state, primary, pedal_states[3];
+  int loop_pos, loop_end, history_pos, loop_count;
+  int track_speed[3], track_interp[3];
+  int track_num[3], track_den[3];
+  int track_recorded[3];
+  long long frames_run;
+  struct gestures gestures;
+  struct effect effects[3][MAX_FX];
+  int speed_want[3];
+  int shed;
+  long long shed_changed;
+  double shed_before_ns[SHED_HASH + 1], shed_saved_ns[SHED_HASH + 1];
+  struct loudness loudness[3];
+  float auto_gain[3];
+  unsigned char track_silent[3][SILENT_BLOCKS];
+
+  jack_default_audio_sample_t limiter_delay_buf[LIMITER_LOOKAHEAD + LIMITER_BLOCK];
+  int limiter_delay_pos;
+  float limiter_x1, limiter_x2, limiter_x3;
+  float hold_vals[HOLD_LEN];
+  long long hold_when[HOLD_LEN];
+  int hold_head, hold_len;
+  long long limiter_n;
+  float box_vals[BOX_LEN];
+  int box_pos;
+  double box_sum;
+  float limiter_gain;
+};
+
+struct flight_header {
+  char magic[8];
+  int sample_rate, amt_mem, history_len;
+  int key_size, cycle_size; /* only replay with the build that wrote it */
+  int sync_mode;            /* a follower's primary waits for the top */
+  long long n_cycles, n_frames;
+};
+
+jack_default_audio_sample_t *flight_input;
+struct flight_cycle *flight_cycles;
+struct flight_key flight_keys[FLIGHT_KEYS];
+
+/* written only by process() */
+volatile long long flight_frame = 0;   /* input frames so far */
+volatile long long flight_n_cycles = 0;
+volatile long long flight_n_keys = 0;
+long long flight_next_key = 0;
+
+/* the record for the cycle in progress, if we're recording */
+struct flight_cycle *flight_now = NULL;
+
+/* owned by the main thread: the loop buffers as they were at
+   flight_keys[flight_base_key] */
+jack_default_audio_sample_t *flight_base;
+long long flight_base_key = 0;
+int flight_ok = 1;
+
+volatile sig_atomic_t flight_wanted = 0;
+
+void flight_init()
+{
+  flight_input = alloc_audio_mem(FLIGHT_INPUT_LEN);
+  flight_cycles = alloc_locked_mem(FLIGHT_CYCLES * sizeof(struct flight_cycle));
+  flight_base = alloc_audio_mem(AMT_MEM*3);
+}
+
+struct ring flight_input_ring()
+{
+  struct ring r = {flight_input, FLIGHT_INPUT_LEN};
+  return r;
+}
+
+/* fnv-1a over the bits of the samples */
+unsigned flight_hash(jack_default_audio_sample_t *buf, int n)
+{
+  unsigned h = 2166136261u;
+  for (int i = 0 ; i < n ; i++) {
+    unsigned bits;
+    memcpy(&bits, &buf[i], sizeof(bits));
+    h = (h ^ bits) * 16777619u;
+  }
+  return h;
+}
+
+void flight_save_key(struct flight_key *key)
+{
+  key->state = state;
+  key->primary = primary;
+  memcpy(key->pedal_states, pedal_states, sizeof(pedal_states));
+  key->loop_pos = loop_pos;
+  key->loop_end = loop_end;
+  key->history_pos = history_pos;
+  key->loop_count = loop_count;
+  memcpy(key->track_speed, track_speed, sizeof(track_speed));
+  memcpy(key->track_interp, track_interp, sizeof(track_interp));
+  memcpy(key->track_recorded, track_recorded, sizeof(track_recorded));
+  memcpy(key->track_num, track_num, sizeof(track_num));
+  memcpy(key->track_den, track_den, sizeof(track_den));
+  key->frames_run = frames_run;
+  key->gestures = gestures;
+  memcpy(key->effects, effects, sizeof(effects));
+  memcpy(key->speed_want, speed_want, sizeof(speed_want));
+  key->shed = shed;
+  key->shed_changed = shed_changed;
+  memcpy(key->shed_before_ns, shed_before_ns, sizeof(shed_before_ns));
+  memcpy(key->shed_saved_ns, shed_saved_ns, sizeof(shed_saved_ns));
+  memcpy(key->loudness, loudness, sizeof(loudness));
+  memcpy(key->auto_gain, auto_gain, sizeof(auto_gain));
+  memcpy(key->track_silent, track_silent, sizeof(track_silent));
+
+  memcpy(key->limiter_delay_buf, limiter_delay_buf, sizeof(limiter_delay_buf));
+  key->limiter_delay_pos = limiter_delay_pos;
+  key->limiter_x1 = limiter_x1;
+  key->limiter_x2 = limiter_x2;
+  key->limiter_x3 = limiter_x3;
+  memcpy(key->hold_vals, hold_vals, sizeof(hold_vals));
+  memcpy(key->hold_when, hold_when, sizeof(hold_when));
+  key->hold_head = hold_head;
+  key->hold_len = hold_len;
+  key->limiter_n = limiter_n;
+  memcpy(key->box_vals, box_vals, sizeof(box_vals));
+  key->box_pos = box_pos;
+  key->box_sum = box_sum;
+  key->limiter_gain = limiter_gain;
+}
+
+/* the effects keep their own delay lines, which start out silent */
+void flight_load_key(struct flight_key *key)
+{
+  state = key->state;
+  primary = key->primary;
+  memcpy(pedal_states, key->pedal_states, sizeof(pedal_states));
+  loop_pos = key->loop_pos;
+  loop_end = key->loop_end;
+  history_pos = key->history_pos;
+  loop_count = key->loop_count;
+  memcpy(track_speed, key->track_speed, sizeof(track_speed));
+  memcpy(track_interp, key->track_interp, sizeof(track_interp));
+  memcpy(track_recorded, key->track_recorded, sizeof(track_recorded));
+  memcpy(track_num, key->track_num, sizeof(track_num));
+  memcpy(track_den, key->track_den, sizeof(track_den));
+  frames_run = key->frames_run;
+  gestures = key->gestures;
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    for (int slot = 0 ; slot < MAX_FX ; slot++) {
+      jack_default_audio_sample_t *line = effects[pedal][slot].line;
+      effects[pedal][slot] = key->effects[pedal][slot];
+      effects[pedal][slot].line = line;
+    }
+  }
+  memcpy(speed_want, key->speed_want, sizeof(speed_want));
+  shed = key->shed;
+  shed_changed = key->shed_changed;
+  memcpy(shed_before_ns, key->shed_before_ns, sizeof(shed_before_ns));
+  memcpy(shed_saved_ns, key->shed_saved_ns, sizeof(shed_saved_ns));
+  memcpy(loudness, key->loudness, sizeof(loudness));
+  memcpy(auto_gain, key->auto_gain, sizeof(auto_gain));
+  memcpy(track_silent, key->track_silent, sizeof(track_silent));
+
+  memcpy(limiter_delay_buf, key->limiter_delay_buf, sizeof(limiter_delay_buf));
+  limiter_delay_pos = key->limiter_delay_pos;
+  limiter_x1 = key->limiter_x1;
+  limiter_x2 = key->limiter_x2;
+  limiter_x3 = key->limiter_x3;
+  memcpy(hold_vals, key->hold_vals, sizeof(hold_vals));
+  memcpy(hold_when, key->hold_when, sizeof(hold_when));
+  hold_head = key->hold_head;
+  hold_len = key->hold_len;
+  limiter_n = key->limiter_n;
+  memcpy(box_vals, key->box_vals, sizeof(box_vals));
+  box_pos = key->box_pos;
+  box_sum = key->box_sum;
+  limiter_gain = key->limiter_gain;
+}
+
+/* process(), before running the engine: note down what it's about to
+   be given, and take a keyframe if it's time */
+void flight_begin(jack_nframes_t nframes, jack_default_audio_sample_t *in,
+		  struct cycle_input *input)
+{
+  if (flight_frame >= flight_next_key) {
+    struct flight_key *key = &flight_keys[flight_n_keys % FLIGHT_KEYS];
+    key->cycle = flight_n_cycles;
+    key->frame = flight_frame;
+    flight_save_key(key);
+    __sync_synchronize();
+    flight_n_keys++;
+    flight_next_key += FLIGHT_KEY_SECONDS*SAMPLE_RATE;
+  }
+
+  struct flight_cycle *rec = &flight_cycles[flight_n_cycles % FLIGHT_CYCLES];
+  rec->frame = flight_frame;
+  rec->nframes = nframes;
+  rec->input = *input;
+  rec->params = *cur_params;
+  rec->loop_pos = loop_pos;
+  rec->loop_end = loop_end;
+  rec->following = following;
+  rec->fx_want = 0;
+  for (int fx = 0 ; fx < 3*MAX_FX ; fx++) {
+    if (effects[fx / MAX_FX][fx % MAX_FX].want_on) { rec->fx_want |= 1 << fx; }
+  }
+  rec->cycle_ns = cycle_ns;
+  rec->late_pedal = -1;
+  rec->rec_mask = 0;
+
+  ring_write(flight_input_ring(), flight_frame % FLIGHT_INPUT_LEN, in, nframes);
+  flight_now = rec;
+}
+
+/* process(), after: hash what we played and publish the record */
+void flight_end(jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+  flight_now->hashed = shed < SHED_HASH;
+  if (flight_now->hashed) {
+    flight_now->out_hash = flight_hash(out, nframes);
+  }
+  flight_now = NULL;
+  __sync_synchronize();
+  flight_frame += nframes;
+  flight_n_cycles++;
+}
+
+/* called by the engine when it writes into a loop buffer */
+void flight_note_rec(int pedal, int off, int n, int pos, int len)
+{
+  if (!flight_now) { return; }
+  flight_now->rec_mask |= 1 << pedal;
+  flight_now->rec_off[pedal] = off;
+  flight_now->rec_n[pedal] = n;
+  flight_now->rec_pos[pedal] = pos;
+  flight_now->rec_len[pedal] = len;
+}
+
+void flight_note_late(int pedal, int len)
+{
+  if (!flight_now) { return; }
+  flight_now->late_pedal = pedal;
+  flight_now->late_len = len;
+}
+
+/* dst[pos, pos+n) = the input we got starting at frame */
+void flight_copy_input(long long frame, int n, struct ring dst, int pos)
+{
+  struct span spans[2];
+  int n_spans = ring_spans(flight_input_ring(), frame % FLIGHT_INPUT_LEN, n, spans);
+
+  for (int s = 0 ; s < n_spans ; s++) {
+    ring_write(dst, pos, spans[s].buf, spans[s].len);
+    pos += spans[s].len;
+  }
+}
+
+/* do to flight_base what this cycle did to loop_bufs */
+void flight_apply(struct flight_cycle *rec)
+{
+  if (rec->late_pedal >= 0) {
+    struct ring r = {flight_base + AMT_MEM*rec->late_pedal, AMT_MEM};
+    flight_copy_input(rec->frame - rec->late_len, rec->late_len, r, 0);
+  }
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    if (rec->rec_mask & (1 << pedal)) {
+      struct ring r = {flight_base + AMT_MEM*pedal, rec->rec_len[pedal]};
+      flight_copy_input(rec->frame + rec->rec_off[pedal], rec->rec_n[pedal],
+			r, rec->rec_pos[pedal]);
+    }
+  }
+}
+
+/* main thread: move flight_base up to the newest keyframe that's
+   fallen out of the window.  Needs calling at least every
+   FLIGHT_KEY_SECONDS. */
+void flight_advance()
+{
+  long long window_start = flight_frame - FLIGHT_SECONDS*SAMPLE_RATE;
+
+  if (!flight_ok) { return; }
+  while (flight_base_key + 1 < flight_n_keys) {
+    struct flight_key *base = &flight_keys[flight_base_key % FLIGHT_KEYS];
+    struct flight_key *next = &flight_keys[(flight_base_key + 1) % FLIGHT_KEYS];
+    if (next->frame > window_start) { break; }
+
+    if (flight_n_cycles - base->cycle > FLIGHT_CYCLES ||
+	flight_frame - base->frame > FLIGHT_INPUT_LEN - HISTORY_LEN) {
+      printf("flight recorder overrun (periods under %d frames?), stopping it\n",
+	     FLIGHT_MIN_NFRAMES);
+      flight_ok = 0;
+      return;
+    }
+    for (long long c = base->cycle ; c < next->cycle ; c++) {
+      flight_apply(&flight_cycles[c % FLIGHT_CYCLES]);
+    }
+    flight_base_key++;
+  }
+}
+
+/* main thread: write out everything from the base keyframe on */
+void flight_dump()
+{
+  struct flight_header header = {"LPFLIGHT", SAMPLE_RATE, AMT_MEM, HISTORY_LEN,
+				 sizeof(struct flight_key),
+				 sizeof(struct flight_cycle), sync_mode, 0, 0};
+  struct span spans[2];
+  FILE *f;
+
+  flight_advance();
+  if (!flight_ok) {
+    printf("flight recorder stopped, nothing to dump\n");
+    return;
+  }
+
+  struct flight_key *key = &flight_keys[flight_base_key % FLIGHT_KEYS];
+  long long end_cycle = flight_n_cycles;
+  if (end_cycle == key->cycle || !flight_n_keys) {
+    printf("flight recorder is empty\n");
+    return;
+  }
+  long long end_frame = flight_cycles[(end_cycle - 1) % FLIGHT_CYCLES].frame +
+    flight_cycles[(end_cycle - 1) % FLIGHT_CYCLES].nframes;
+  long long first_frame = key->frame - HISTORY_LEN;
+
+  header.n_cycles = end_cycle - key->cycle;
+  header.n_frames = end_frame - first_frame;
+
+  if (!(f = fopen(FLIGHT_FILE, "wb"))) {
+    perror("open " FLIGHT_FILE);
+    return;
+  }
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(key, sizeof(*key), 1, f);
+  fwrite(flight_base, sizeof(jack_default_audio_sample_t), AMT_MEM*3, f);
+  for (long long c = key->cycle ; c < end_cycle ; c++) {
+    fwrite(&flight_cycles[c % FLIGHT_CYCLES], sizeof(struct flight_cycle), 1, f);
+  }
+  for (long long frame = first_frame ; frame < end_frame ; ) {
+    int n = end_frame - frame < SAMPLE_RATE ? end_frame - frame : SAMPLE_RATE;
+    int n_spans = ring_spans(flight_input_ring(), frame % FLIGHT_INPUT_LEN, n, spans);
+    for (int s = 0 ; s < n_spans ; s++) {
+      fwrite(spans[s].buf, sizeof(jack_default_audio_sample_t), spans[s].len, f);
+    }
+    frame += n;
+  }
+  fclose(f);
+
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    for (int slot = 0 ; slot < MAX_FX ; slot++) {
+      struct effect *fx = &key->effects[pedal][slot];
+      if (fx->on && fx->line) {
+	printf("fx %d.%d %s was running, its tail won't replay exactly\n",
+	       pedal, slot, fx_names[fx->type]);
+      }
+    }
+  }
+  printf("wrote %lld cycles (%.1fs) to %s\n", header.n_cycles,
+	 (double)(end_frame - key->frame) / SAMPLE_RATE, FLIGHT_FILE);
+}
+
+void flight_signal(int sig)
+{
+  flight_wanted = 1;
+}
+
+/* a pedal was pressed late samples after the top of its track:
+   copy what we heard since the top out of the history into this
+   pedal's buffer, as if we'd been recording all along. */
+void record_from_history(int pedal, int late)
+{
+  struct span spans[2];
+  int n_spans = ring_spans(history_ring(), history_pos - late, late, spans);
+  int dst = 0;
+
+  take_start(pedal);
+  for (int s = 0 ; s < n_spans ; s++) {
+    memcpy(&loop_bufs[AMT_MEM*pedal + dst], spans[s].buf,
+	   spans[s].len * sizeof(jack_default_audio_sample_t));
+    take_write(pedal, dst, AMT_MEM, spans[s].buf, spans[s].len);
+    dst += spans[s].len;
+  }
+  flight_note_late(pedal, late);
+}
+
+/* the buttons held down in a mouse byte, as a mask of pedals */
+int pedals_down(char b)
+{
+  return ((b & 0x2) ? 1 << MOUSE_A : 0) |
+    ((b & 0x1) ? 1 << MOUSE_4 : 0) |
+    ((b & 0x4) ? 1 << MOUSE_3 : 0);
+}
+
+/* read whatever the mouse has sent since last time.  Fills in which
+   pedals were down after each change, at most max of them, and
+   returns how many. */
+int read_buttons(int *downs, int max)
+{
+  static int last_down = 0;
+  int n = 0;
+
+  if ((amt_read_mouse = read(mouse_fd, mouse_buf, MAX_MOUSE_READ)) == -1){
+    if (errno != EINTR && errno != EAGAIN) {
+      perror("badness");
+      exit(-1);
+    }
+  }
+  else {
+    for (int i = 0 ; i < amt_read_mouse ; i++){
+      if (mouse_buf[i] == 0x0) {} // padding
+      else if ((mouse_buf[i] & 0xF8) == 0x8) {
+	int down = pedals_down(mouse_buf[i]);
+	if (down != last_down && n < max) {
+	  downs[n++] = down;
+	  last_down = down;
+	}
+      }
+      else { printf ("mouse: other (%x)\n", mouse_buf[i]);  }
+    }
+  }
+  return n;
+}
+        
+
+/* a tap on a pedal, which went down late frames ago.  Anything that
+   depends on when it happened is worked out as of then, taking what
+   we've heard since from the history, so a tap held up deciding
+   whether it's a chord still lands on its frame. */
+void respond_to_mouse(int mouse_press, int late) {
+  if (mouse_press == MOUSE_None) { return; }
+
+  if (state == STATE_OFF && following) {
+    /* the leader's loop is already going: wait for its top and then
+       record one time through, like any other secondary */
+    primary = mouse_press;
+    state = STATE_PLY;
+    track_num[primary] = track_den[primary] = 1;
+    memset(track_recorded, 0, sizeof(track_recorded));
+    pedal_states[0] = pSTATE_OFF;
+    pedal_states[1] = pSTATE_OFF;
+    pedal_states[2] = pSTATE_OFF;
+    if (loop_pos > 0 && loop_pos < late) {
+      /* the top went by since it was tapped */
+      printf ("late start recording primary %d with leader (%d late)\n",
+	      primary, loop_pos);
+      record_from_history(primary, loop_pos);
+      pedal_states[primary] = pSTATE_REC;
+    }
+    else {
+      printf ("waiting to record primary %d with leader\n", primary);
+      pedal_states[primary] = pSTATE_WAIT_REC;
+    }
+  }
+  else if (state == STATE_OFF) {
+    primary = mouse_press;
+    printf ("recording primary %d\n", primary);
+    state = STATE_PRI_REC;
+    track_num[primary] = track_den[primary] = 1;
+    memset(track_recorded, 0, sizeof(track_recorded));
+    pedal_states[0] = pSTATE_OFF;
+    pedal_states[1] = pSTATE_OFF;
+    pedal_states[2] = pSTATE_OFF;
+    pedal_states[primary] = pSTATE_REC;
+
+    /* the loop started when the pedal went down */
+    record_from_history(primary, late);
+    loop_pos = late;
+  }
+  else if (state == STATE_PRI_REC){
+    if (mouse_press == primary) {
+      printf ("playing primary %d\n", primary);
+      state = STATE_PLY;
+      pedal_states[primary] = pSTATE_PLY;
+      track_recorded[primary] = 1;
+      loudness_finish(primary);
+      /* and ended then too: we're already late into the next time
+	 round, which is the start of the take again */
+      loop_end = loop_pos - late;
+      loop_pos = late;
+      loop_count = 0;
+      for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	if (!ratio_fits(pedal, track_num[pedal], track_den[pedal])) {
+	  printf ("track %d can't be %d/%d of this loop, making it 1/1\n",
+		  pedal, track_num[pedal], track_den[pedal]);
+	  track_num[pedal] = track_den[pedal] = 1;
+	}
+      }
+    }
+    else { state = STATE_OFF; }
+  }
+  else if (state == STATE_PLY){
+    
+    if (mouse_press == primary) {
+      for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	if (pedal != primary && pedal_states[pedal] == pSTATE_PLY) {
+	  primary = pedal;
+	  break;
+	}
+      }
+      if (mouse_press == primary) {
+	printf ("failed to find new primary\n");
+	state = STATE_OFF;
+	printf ("off\n");
+      }
+    }
+    else {
+      if (pedal_states[mouse_press] == pSTATE_PLY) {
+	printf ("stopping %d\n", mouse_press);
+	pedal_states[mouse_press] = pSTATE_OFF;
+      }
+      else if (pedal_states[mouse_press] == pSTATE_OFF &&
+	       heads[mouse_press].pos > 0 &&
+	       heads[mouse_press].pos - late < LATE_WINDOW) {
+	printf ("late start recording secondary %d (%d late)\n",
+		mouse_press, heads[mouse_press].pos);
+	record_from_history(mouse_press, heads[mouse_press].pos);
+	pedal_states[mouse_press] = pSTATE_REC;
+	track_recorded[mouse_press] = 0;
+      }
+      else {
+	printf ("waiting to record secondary %d\n", mouse_press);
+	pedal_states[mouse_press] = pSTATE_WAIT_REC;
+      }
+    }
+  }
+}
+
+/*** gesture stuff ***/
+
+/* Each pedal does one thing when tapped, but it can also do something
+   else on a long press or a double tap, and pressing pedals together
+   is a chord.  A tap normally fires CHORD_MS after the pedal goes
+   down, or when it comes up if that's sooner, unless another pedal
+   has gone down by then: a chord mustn't start with a tap that's
+   already changed the show.  It then acts as of the frame the pedal
+   went down (see respond_to_mouse()), so recordings start and loops
+   end exactly where they were tapped.  When the pedal has a long
+   press or double tap action in the current state we have to wait
+   longer: then a tap fires when the pedal comes back up (at most
+   LONG_PRESS_MS), or DOUBLE_TAP_MS after that if a double tap is
+   possible.  A chord fires when the first of its pedals comes back
+   up, and cancels any taps of its pedals still waiting.
+
+   This runs inside run_cycle(), timed in frames, so the flight
+   recorder can replay it. */
+#define LONG_PRESS_FRAMES (LONG_PRESS_MS*SAMPLE_RATE/1000)
+#define DOUBLE_TAP_FRAMES (DOUBLE_TAP_MS*SAMPLE_RATE/1000)
+#define CHORD_FRAMES (CHORD_MS*SAMPLE_RATE/1000)
+
+/* long press: the next speed for a playing track */
+int long_bound(int pedal)
+{
+  return state == STATE_PLY && pedal_states[pedal] == pSTATE_PLY;
+}
+
+void respond_to_long(int pedal)
+{
+  next_speed(pedal);
+  printf ("long press %d: speed %g\n", pedal, varispeeds[speed_want[pedal]]);
+}
+
+/* double tap: bring back a stopped track without recording over it */
+int double_bound(int pedal)
+{
+  return state == STATE_PLY && pedal_states[pedal] == pSTATE_OFF &&
+    track_recorded[pedal];
+}
+
+void respond_to_double(int pedal)
+{
+  printf ("double tap %d: playing again\n", pedal);
+  pedal_states[pedal] = pSTATE_PLY;
+}
+
+/* two pedals stop everything, all three dump the flight recorder */
+void respond_to_chord(int chord)
+{
+  if (chord == 7) {
+    printf ("chord: dumping flight recorder\n");
+    flight_wanted = 1;
+  }
+  else {
+    printf ("chord: all off\n");
+    state = STATE_OFF;
+  }
+}
+
+/* the pedals down changed to down at frame now */
+void gesture_event(int down, long long now)
+{
+  int pressed = down & ~gestures.down;
+  int released = gestures.down & ~down;
+
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    struct pedal_gesture *g = &gestures.pedals[pedal];
+
+    if (pressed & (1 << pedal)) {
+      g->down = 1;
+      g->down_at = now;
+      if (gestures.down) {
+	/* joining a chord: nothing else this press could be */
+	gestures.chord |= gestures.down | (1 << pedal);
+	for (int p = 0 ; p < 3 ; p++) {
+	  if (gestures.chord & (1 << p)) {
+	    gestures.pedals[p].pending = gestures.pedals[p].tapped = 0;
+	    gestures.pedals[p].chording = 0;
+	  }
+	}
+      }
+      else if (g->tapped && double_bound(pedal)) {
+	g->tapped = 0;
+	respond_to_double(pedal);
+      }
+      else {
+	if (g->tapped) {
+	  g->tapped = 0;
+	  respond_to_mouse(pedal, 0);
+	}
+	if (long_bound(pedal) || double_bound(pedal)) { g->pending = 1; }
+	else { g->chording = 1; }
+      }
+    }
+
+    if (released & (1 << pedal)) {
+      g->down = 0;
+      g->up_at = now;
+      if (g->pending) {
+	g->pending = 0;
+	if (double_bound(pedal)) { g->tapped = 1; }
+	else { respond_to_mouse(pedal, 0); }
+      }
+      if (g->chording) {
+	/* up again before anything joined it */
+	g->chording = 0;
+	respond_to_mouse(pedal, now - g->down_at);
+      }
+    }
+  }
+
+  if (released && gestures.chord && !gestures.chord_done) {
+    respond_to_chord(gestures.chord);
+    gestures.chord_done = 1;
+  }
+  gestures.down = down;
+  if (!down) {
+    gestures.chord = 0;
+    gestures.chord_done = 0;
+  }
+}
+
+/* decide anything that's been waiting long enough */
+void gesture_poll(long long now)
+{
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    struct pedal_gesture *g = &gestures.pedals[pedal];
+
+    if (g->chording && now - g->down_at >= CHORD_FRAMES) {
+      g->chording = 0;
+      respond_to_mouse(pedal, now - g->down_at);
+    }
+    if (g->pending && now - g->down_at >= LONG_PRESS_FRAMES) {
+      g->pending = 0;
+      if (long_bound(pedal)) { respond_to_long(pedal); }
+      else { respond_to_mouse(pedal, 0); }
+    }
+    if (g->tapped && now - g->up_at >= DOUBLE_TAP_FRAMES) {
+      g->tapped = 0;
+      respond_to_mouse(pedal, 0);
+    }
+  }
+}
+
+/*** control stuff ***/
+
+/* Besides the pedals we can be told what to do over OSC (UDP on
+   localhost, the first free port from CONTROL_OSC_PORT up) or by
+   writing lines of text to the unix socket CONTROL_SOCKET, named for
+   our jack client, so a tablet or a script can run things too.  Both
+   are printed at startup, and both understand the same commands:
+
+     tap TRACK                 like tapping that pedal
+     speed TRACK [N|next]      play at varispeeds[N]
+     gain TRACK GAIN           0 to MAX_TRACK_GAIN
+     interp TRACK linear|sinc
+     fx TRACK SLOT on|off
+     length TRACK NUM DEN      make the track NUM/DEN of the loop
+     off                       stop everything
+     dump                      write out the flight recorder
+     state                     what we're doing
+     peaks TRACK [WIDTH]       a waveform overview: hex min and max bytes
+                               for each of WIDTH pixels
+
+   Over OSC the address is /looper/COMMAND, and the reply comes back
+   as a /looper/reply message with a single string.
+
+   A server thread handles all of this.  Things that change what the
+   engine is doing go on to process() through a queue that only this
+   thread writes and only process() reads, so neither ever waits for
+   the other.  Gains and interpolation are params: the server fills in
+   a new copy and swaps the pointer, and reuses the old copy once
+   process() has finished a cycle since then. */
+#define CONTROL_OSC_PORT 9877 /* the first port we try */
+#define CONTROL_OSC_PORTS 16   /* and how many we try */
+#define CONTROL_SOCKET "/tmp/looper_sync-%s.sock" /* %s is the client name */
+#define CONTROL_QUEUE_LEN 64 /* a power of two */
+#define MAX_CONTROL_CLIENTS 4
+#define MAX_CONTROL_LINE 256
+#define MAX_CONTROL_REPLY 1024
+#define MAX_TRACK_GAIN 4.0 /* about +12dB */
+
+/* a peaks reply is four hex digits a pixel */
+#define PEAKS_WIDTH 100
+#define PEAKS_MAX_WIDTH 200
+#define PARAMS_POOL 4
+
+#define CMD_TAP   1
+#define CMD_SPEED 2 /* arg is the speed, or -1 for the next one */
+#define CMD_FX    3 /* arg is the slot, value is on or off */
+#define CMD_OFF   4
+#define CMD_DUMP  5
+#define CMD_LENGTH 6 /* arg is num, value is den */
+
+struct command control_queue[CONTROL_QUEUE_LEN];
+volatile unsigned queue_head = 0; /* written by the server */
+volatile unsigned queue_tail = 0; /* written by process() */
+
+/* server: returns 0 if the queue is full */
+int push_command(struct command *cmd)
+{
+  if (queue_head - queue_tail == CONTROL_QUEUE_LEN) { return 0; }
+  control_queue[queue_head % CONTROL_QUEUE_LEN] = *cmd;
+  __sync_synchronize();
+  queue_head++;
+  return 1;
+}
+
+/* process(): take up to max commands off the queue */
+int take_commands(struct command *cmds, int max)
+{
+  int n = 0;
+  while (n < max && queue_tail != queue_head) {
+    __sync_synchronize();
+    cmds[n++] = control_queue[queue_tail % CONTROL_QUEUE_LEN];
+    __sync_synchronize();
+    queue_tail++;
+  }
+  return n;
+}
+
+/* the engine's side of a command */
+void do_command(struct command *cmd)
+{
+  switch (cmd->type) {
+  case CMD_TAP:
+    respond_to_mouse(cmd->track, 0);
+    break;
+  case CMD_SPEED:
+    if (cmd->arg < 0) { next_speed(cmd->track); }
+    else { speed_want[cmd->track] = cmd->arg; }
+    break;
+  case CMD_FX:
+    effects[cmd->track][cmd->arg].want_on = cmd->value != 0;
+    break;
+  case CMD_OFF:
+    printf ("off\n");
+    state = STATE_OFF;
+    break;
+  case CMD_DUMP:
+    flight_wanted = 1;
+    break;
+  case CMD_LENGTH:
+    if (ratio_fits(cmd->track, cmd->arg, cmd->value)) {
+      track_num[cmd->track] = cmd->arg;
+      track_den[cmd->track] = cmd->value;
+      printf ("track %d is %d/%d of the loop\n", cmd->track,
+	      track_num[cmd->track], track_den[cmd->track]);
+    }
+    else {
+      printf ("track %d can't be %d/%d of this loop\n", cmd->track,
+	      cmd->arg, (int)cmd->value);
+    }
+    break;
+  }
+}
+
+/* the params we hand out, and for each the cycles_done when it was
+   swapped out, or -1 while it's current */
+struct params params_pool[PARAMS_POOL];
+long long params_retired[PARAMS_POOL];
+volatile long long cycles_done = 0; /* process() cycles finished */
+
+/* server: make new the current params.  Returns 0 if process() isn't
+   letting go of the old ones. */
+int set_params(struct params *new)
+{
+  struct params *old = params;
+
+  for (int tries = 0 ; tries < 100 ; tries++) {
+    for (int i = 0 ; i < PARAMS_POOL ; i++) {
+      if (&params_pool[i] != old && params_retired[i] >= 0 &&
+	  cycles_done > params_retired[i]) {
+	params_pool[i] = *new;
+	params_retired[i] = -1;
+	__sync_synchronize();
+	params = &params_pool[i];
+	__sync_synchronize();
+	if (old != &default_params) {
+	  params_retired[old - params_pool] = cycles_done;
+	}
+	return 1;
+      }
+    }
+    usleep(1000);
+  }
+  return 0;
+}
+
+/* what we're doing, published by process() for the server to read,
+   the same way as the sync clocks */
+struct status {
+  int state, primary, loop_pos, loop_end;
+  int pedal_states[3];
+  float speed[3], gain[3];
+  int num[3], den[3];
+};
+
+struct shared_status {
+  volatile unsigned seq;
+  struct status status;
+} shared_status;
+
+void publish_status()
+{
+  shared_status.seq++;
+  __sync_synchronize();
+  shared_status.status.state = state;
+  shared_status.status.primary = primary;
+  shared_status.status.loop_pos = loop_pos;
+  shared_status.status.loop_end = loop_end;
+  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+    shared_status.status.pedal_states[pedal] =
+      state == STATE_OFF ? pSTATE_OFF : pedal_states[pedal];
+    shared_status.status.speed[pedal] = varispeeds[track_speed[pedal]];
+    shared_status.status.gain[pedal] = cur_params->track_gain[pedal];
+    shared_status.status.num[pedal] = track_num[pedal];
+    shared_status.status.den[pedal] = track_den[pedal];
+  }
+  __sync_synchronize();
+  shared_status.seq++;
+}
+
+void read_status(struct status *status)
+{
+  unsigned seq;
+  do {
+    seq = shared_status.seq;
+    __sync_synchronize();
+    *status = shared_status.status;
+    __sync_synchronize();
+  } while ((seq & 1) || seq != shared_status.seq);
+}
+
+const char *state_name(int s)
+{
+  switch (s) {
+  case STATE_OFF: return "off";
+  case STATE_PRI_REC: return "recording";
+  case STATE_PLY: return "playing";
+  case pSTATE_OFF: return "off";
+  case pSTATE_WAIT_REC: return "waiting";
+  case pSTATE_REC: return "recording";
+  case pSTATE_PLY: return "playing";
+  }
+  return "?";
+}
+
+/* words some commands take instead of numbers */
+int control_arg(const char *word, float *value)
+{
+  char *end;
+
+  if (!strcmp(word, "on") || !strcmp(word, "sinc")) { *value = 1; }
+  else if (!strcmp(word, "off") || !strcmp(word, "linear")) { *value = 0; }
+  else if (!strcmp(word, "next")) { *value = -1; }
+  else {
+    *value = strtof(word, &end);
+    if (end == word || *end) { return 0; }
+  }
+  return 1;
+}
+
+/* server: carry out a command, putting what to say back in reply */
+void control(const char *verb, float *args, int n_args,
+	     char *reply, int reply_len)
+{
+  struct command cmd = {0, 0, 0, 0};
+  int track = n_args > 0 ? args[0] : -1;
+
+  if (!strcmp(verb, "state")) {
+    struct status st;
+    read_status(&st);
+    snprintf(reply, reply_len, "%s primary %d pos %d end %d tracks %s %s %s "
+	     "speeds %g %g %g gains %g %g %g lengths %d/%d %d/%d %d/%d",
+	     state_name(st.state),
+	     st.primary, st.loop_pos, st.loop_end,
+	     state_name(st.pedal_states[0]), state_name(st.pedal_states[1]),
+	     state_name(st.pedal_states[2]), st.speed[0], st.speed[1],
+	     st.speed[2], st.gain[0], st.gain[1], st.gain[2],
+	     st.num[0], st.den[0], st.num[1], st.den[1], st.num[2], st.den[2]);
+    return;
+  }
+
+  if (!strcmp(verb, "peaks")) {
+    struct status st;
+    struct peak px[PEAKS_MAX_WIDTH];
+    int width = n_args == 2 ? args[1] : PEAKS_WIDTH;
+    if (n_args < 1 || n_args > 2 || track < 0 || track > 2 ||
+	width < 1 || width > PEAKS_MAX_WIDTH) {
+      snprintf(reply, reply_len, "error: peaks TRACK [WIDTH up to %d]",
+	       PEAKS_MAX_WIDTH);
+      return;
+    }
+
+    /* how long the track is, as far as the last cycle knew */
+    read_status(&st);
+    int len = st.state == STATE_PRI_REC ? st.loop_pos :
+      (long long)st.loop_end * st.num[track] / st.den[track];
+    int pos = snprintf(reply, reply_len, "gen %u len %d ",
+		       track_peaks[track].gen, len);
+    if (len <= 0) { return; }
+
+    peaks_overview(track, len, width, px);
+    for (int x = 0 ; x < width && pos < reply_len ; x++) {
+      pos += snprintf(reply + pos, reply_len - pos, "%02x%02x",
+		      (unsigned char)px[x].min, (unsigned char)px[x].max);
+    }
+    return;
+  }
+
+  if (!strcmp(verb, "gain") || !strcmp(verb, "interp")) {
+    struct params new = *params;
+    if (n_args != 2 || track < 0 || track > 2) {
+      snprintf(reply, reply_len, "error: %s TRACK VALUE", verb);
+      return;
+    }
+    if (verb[0] == 'g' && !(isfinite(args[1]) && args[1] >= 0 &&
+			    args[1] <= MAX_TRACK_GAIN)) {
+      snprintf(reply, reply_len, "error: gain 0 to %g", MAX_TRACK_GAIN);
+      return;
+    }
+    if (verb[0] == 'g') { new.track_gain[track] = args[1]; }
+    else { new.interp[track] = args[1] ? INTERP_SINC : INTERP_LINEAR; }
+    snprintf(reply, reply_len, set_params(&new) ? "ok" : "error: busy");
+    return;
+  }
+
+  if (!strcmp(verb, "tap") && n_args == 1) {
+    cmd.type = CMD_TAP;
+  }
+  else if (!strcmp(verb, "speed") && (n_args == 1 || n_args == 2)) {
+    cmd.type = CMD_SPEED;
+    cmd.arg = n_args == 2 ? args[1] : -1;
+    if (cmd.arg >= (int)N_VARISPEEDS) {
+      snprintf(reply, reply_len, "error: only %d speeds", (int)N_VARISPEEDS);
+      return;
+    }
+  }
+  else if (!strcmp(verb, "fx") && n_args == 3) {
+    cmd.type = CMD_FX;
+    cmd.arg = args[1];
+    cmd.value = args[2];
+    if (cmd.arg < 0 || cmd.arg >= MAX_FX) {
+      snprintf(reply, reply_len, "error: slots are 0 to %d", MAX_FX - 1);
+      return;
+    }
+  }
+  else if (!strcmp(verb, "length") && n_args == 3) {
+    cmd.type = CMD_LENGTH;
+    cmd.arg = args[1];
+    cmd.value = (int)args[2];
+    if (cmd.arg < 1 || cmd.arg > MAX_RATIO ||
+	cmd.value < 1 || cmd.value > MAX_RATIO) {
+      snprintf(reply, reply_len, "error: NUM and DEN are 1 to %d", MAX_RATIO);
+      return;
+    }
+  }
+  else if (!strcmp(verb, "off") && n_args == 0) {
+    cmd.type = CMD_OFF;
+  }
+  else if (!strcmp(verb, "dump") && n_args == 0) {
+    cmd.type = CMD_DUMP;
+  }
+  else {
+    snprintf(reply, reply_len, "error: don't understand %s", verb);
+    return;
+  }
+
+  if ((cmd.type == CMD_TAP || cmd.type == CMD_SPEED || cmd.type == CMD_FX ||
+       cmd.type == CMD_LENGTH) &&
+      (track < 0 || track > 2)) {
+    snprintf(reply, reply_len, "error: tracks are 0 to 2");
+    return;
+  }
+  cmd.track = track;
+  snprintf(reply, reply_len, push_command(&cmd) ? "ok" : "error: busy");
+}
+
+/* a line of text from the unix socket */
+void control_line(char *line, char *reply, int reply_len)
+{
+  float args[4];
+  int n_args = 0;
+  char *verb = strtok(line, " \t\r\n");
+  char *word;
+
+  if (!verb) {
+    snprintf(reply, reply_len, "error: empty command");
+    return;
+  }
+  while ((word = strtok(NULL, " \t\r\n"))) {
+    if (n_args == 4 || !control_arg(word, &args[n_args++])) {
+      snprintf(reply, reply_len, "error: bad argument %s", word);
+      return;
+    }
+  }
+  control(verb, args, n_args, reply, reply_len);
+}
+
+/* osc strings are nul terminated and padded out to four bytes */
+int osc_string(char *msg, int len, int pos, char **str)
+{
+  int end = pos;
+  while (end < len && msg[end]) { end++; }
+  if (pos >= len || end >= len) { return -1; }
+  *str = msg + pos;
+  return (end + 4) & ~3;
+}
+
+int osc_reply(char *msg, int len, const char *text)
+{
+  int pos = 0;
+  memset(msg, 0, len);
+  strcpy(msg, "/looper/reply");
+  pos = 16;
+  strcpy(msg + pos, ",s");
+  pos += 4;
+  snprintf(msg + pos, len - pos - 4, "%s", text);
+  return (pos + strlen(msg + pos) + 4) & ~3;
+}
 
-/*** jack stuff ***/
-jack_port_t *input_port;
-jack_port_t *output_port;
-jack_client_t *client;
+/* an osc packet from udp: fills in msg with the reply and returns its
+   length */
+int control_osc(char *msg, int len, int max_len)
+{
+  char reply[MAX_CONTROL_REPLY - 32]; /* room for the osc around it */
+  char *addr, *tags, *word;
+  float args[4];
+  int n_args = 0;
+  int pos = osc_string(msg, len, 0, &addr);
 
-/*** mouse stuff ***/
-#define MAX_MOUSE_READ 1024
-int amt_read_mouse = 0;
-char mouse_buf[MAX_MOUSE_READ];
-int mouse_fd;
+  if (pos < 0 || strncmp(addr, "/looper/", 8) ||
+      (pos = osc_string(msg, len, pos, &tags)) < 0 || tags[0] != ',') {
+    return osc_reply(msg, max_len, "error: not an osc message for us");
+  }
+  for (char *tag = tags + 1 ; *tag ; tag++) {
+    unsigned bits;
+    if (n_args == 4) {
+      return osc_reply(msg, max_len, "error: too many arguments");
+    }
+    if (*tag == 'i' || *tag == 'f') {
+      if (pos + 4 > len) { return osc_reply(msg, max_len, "error: truncated"); }
+      memcpy(&bits, msg + pos, 4);
+      bits = ntohl(bits);
+      pos += 4;
+      if (*tag == 'i') { args[n_args++] = (int)bits; }
+      else { memcpy(&args[n_args++], &bits, 4); }
+    }
+    else if (*tag == 's') {
+      if ((pos = osc_string(msg, len, pos, &word)) < 0 ||
+	  !control_arg(word, &args[n_args++])) {
+	return osc_reply(msg, max_len, "error: bad argument");
+      }
+    }
+    else if (*tag == 'T' || *tag == 'F') { args[n_args++] = *tag == 'T'; }
+    else { return osc_reply(msg, max_len, "error: unknown osc type"); }
+  }
 
-/*** state stuff ***/
+  control(addr + 8, args, n_args, reply, sizeof(reply));
+  return osc_reply(msg, max_len, reply);
+}
 
-/* we have two kinds of state: main (int state) and per pedal (int
-   pedal_states[3]).  Allowed states are:
+struct sockaddr_un control_addr;
 
-   main     pedal_state
-   ----     -----------
-   OFF      OFF
-   PRI_REC  one state (primary) is in REC, all others in OFF
-   PLY      one state (primary) is in PLY, all others in any of OFF,
-            WAIT_REC, REC, or PLY
+/* is another looper listening on this socket?  If not, anything there
+   is left over from one that's gone. */
+int socket_live(struct sockaddr_un *addr)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int live = fd != -1 && !connect(fd, (struct sockaddr *)addr, sizeof(*addr));
 
-*/
+  if (fd != -1) { close(fd); }
+  return live;
+}
 
-/* nothing playing */
-#define STATE_OFF 201
+void *control_server(void *arg)
+{
+  int udp = socket(AF_INET, SOCK_DGRAM, 0);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {0};
+  struct pollfd pfds[2 + MAX_CONTROL_CLIENTS];
+  char lines[MAX_CONTROL_CLIENTS][MAX_CONTROL_LINE];
+  int line_len[MAX_CONTROL_CLIENTS];
+  char msg[MAX_CONTROL_REPLY];
 
-/* recording the primary track.  This is the recording that sets the
-   loop length */
-#define STATE_PRI_REC 202
+  if (socket_live(&control_addr)) {
+    fprintf(stderr, "control socket %s is in use\n", control_addr.sun_path);
+    return NULL;
+  }
 
-/* running normally.  Playing at least one track (primary), possibly
-   recording or playing others, a loop length is defined */
-#define STATE_PLY 203
+  /* other loopers on this machine may have the first few ports */
+  int port = CONTROL_OSC_PORT;
+  addr.sin_family = AF_INET;
+  inet_aton("127.0.0.1", &addr.sin_addr);
+  for ( ; udp != -1 && port < CONTROL_OSC_PORT + CONTROL_OSC_PORTS ; port++) {
+    addr.sin_port = htons(port);
+    if (!bind(udp, (struct sockaddr *)&addr, sizeof(addr))) { break; }
+  }
+  if (udp == -1 || port == CONTROL_OSC_PORT + CONTROL_OSC_PORTS) {
+    perror("control osc");
+    return NULL;
+  }
+  unlink(control_addr.sun_path);
+  if (listener == -1 ||
+      bind(listener, (struct sockaddr *)&control_addr, sizeof(control_addr)) ||
+      listen(listener, MAX_CONTROL_CLIENTS)) {
+    perror("control socket");
+    return NULL;
+  }
+  printf("control: osc port %d, socket %s\n", port, control_addr.sun_path);
 
-/* main state */
-int state = STATE_OFF;
+  pfds[0].fd = udp;
+  pfds[1].fd = listener;
+  for (int i = 0 ; i < 2 + MAX_CONTROL_CLIENTS ; i++) {
+    if (i >= 2) { pfds[i].fd = -1; }
+    pfds[i].events = POLLIN;
+  }
 
-/* this pedal is off */
-#define pSTATE_OFF 301
+  while (1) {
+    if (poll(pfds, 2 + MAX_CONTROL_CLIENTS, -1) <= 0) { continue; }
 
-/* this pedal is not primary, it's been pressed, and we're waiting for
-   the beginning of the loop before we start recording. */
-#define pSTATE_WAIT_REC 302
+    if (pfds[0].revents & POLLIN) {
+      struct sockaddr_in from;
+      socklen_t from_len = sizeof(from);
+      int len = recvfrom(udp, msg, sizeof(msg), 0,
+			 (struct sockaddr *)&from, &from_len);
+      if (len > 0) {
+	len = control_osc(msg, len, sizeof(msg));
+	sendto(udp, msg, len, 0, (struct sockaddr *)&from, from_len);
+      }
+    }
 
-/* we're recording to the buffer for this pedal */
-#define pSTATE_REC 303
+    if (pfds[1].revents & POLLIN) {
+      int fd = accept(listener, NULL, NULL);
+      for (int c = 0 ; fd != -1 && c < MAX_CONTROL_CLIENTS ; c++) {
+	if (pfds[2 + c].fd == -1) {
+	  pfds[2 + c].fd = fd;
+	  line_len[c] = 0;
+	  fd = -1;
+	}
+      }
+      if (fd != -1) { close(fd); }
+    }
 
-/* we're playing from the buffer for this pedal */
-#define pSTATE_PLY 304
+    for (int c = 0 ; c < MAX_CONTROL_CLIENTS ; c++) {
+      struct pollfd *pfd = &pfds[2 + c];
+      if (pfd->fd == -1 || !(pfd->revents & (POLLIN | POLLHUP))) { continue; }
 
-/* individual pedal states.  If the main state is OFF then these are
-   ignored.  When the main state becomes PRI_REC all but primary is
-   set to OFF */
-int pedal_states[3];
+      int len = read(pfd->fd, lines[c] + line_len[c],
+		     MAX_CONTROL_LINE - 1 - line_len[c]);
+      if (len <= 0) {
+	close(pfd->fd);
+	pfd->fd = -1;
+	continue;
+      }
+      line_len[c] += len;
 
-/* figure out which button is active, if any.  Returns one of MOUSE_A, MOUSE_4, MOUSE_3, or MOUSE_None */
-int get_mouse()
-{
-  if ((amt_read_mouse = read(mouse_fd, mouse_buf, MAX_MOUSE_READ)) == -1){
-    if (errno != EINTR && errno != EAGAIN) {
-      perror("badness");
-      exit(-1);
-    }
-  }
-  else {
-    for (int i = 0 ; i < amt_read_mouse ; i++){
-      if (mouse_buf[i] == 0x8) {} // mouse up
-      else if (mouse_buf[i] == 0x0) {} // padding
-      else if (mouse_buf[i] == 0xA) { return MOUSE_A; }
-      else if (mouse_buf[i] == 0x9) { return MOUSE_4; }
-      else if (mouse_buf[i] == 0xC) { return MOUSE_3; }
-      else { printf ("mouse: other (%x)\n", mouse_buf[i]);  }
+      /* answer every whole line we have */
+      char *nl;
+      while ((nl = memchr(lines[c], '\n', line_len[c]))) {
+	*nl = '\0';
+	control_line(lines[c], msg, sizeof(msg) - 1);
+	strcat(msg, "\n");
+	write(pfd->fd, msg, strlen(msg));
+	line_len[c] -= nl + 1 - lines[c];
+	memmove(lines[c], nl + 1, line_len[c]);
+      }
+      if (line_len[c] == MAX_CONTROL_LINE - 1) {
+	line_len[c] = 0; /* too long, drop it */
+      }
     }
   }
-  return MOUSE_None;
+  return NULL;
 }
-        
 
-void respond_to_mouse(int mouse_press) {
-  if (mouse_press == MOUSE_None) { return; }
+void start_control(const char *client_name)
+{
+  pthread_t thread;
 
-  if (state == STATE_OFF) {
-    primary = mouse_press;
-    printf ("recording primary %d\n", primary);
-    state = STATE_PRI_REC;
-    pedal_states[0] = pSTATE_OFF;
-    pedal_states[1] = pSTATE_OFF;
-    pedal_states[2] = pSTATE_OFF;
-    pedal_states[primary] = pSTATE_REC;
-    
-    loop_pos = 0;
-  }
-  else if (state == STATE_PRI_REC){
-    if (mouse_press == primary) {
-      printf ("playing primary %d\n", primary);
-      state = STATE_PLY;
-      pedal_states[primary] = pSTATE_PLY;
-      loop_end = loop_pos;
-      loop_pos = 0;
-    }
-    else { state = STATE_OFF; }
+  control_addr.sun_family = AF_UNIX;
+  snprintf(control_addr.sun_path, sizeof(control_addr.sun_path),
+	   CONTROL_SOCKET, client_name);
+
+  if (pthread_create(&thread, NULL, control_server, NULL)) {
+    fprintf(stderr, "cannot start control thread\n");
+    exit(1);
   }
-  else if (state == STATE_PLY){
-    
-    if (mouse_press == primary) {
-      for (int pedal = 0 ; pedal < 3 ; pedal++) {
-	if (pedal != primary && pedal_states[pedal] == pSTATE_PLY) {
-	  primary = pedal;
-	  break;
-	}
-      }
-      if (mouse_press == primary) {
-	printf ("failed to find new primary\n");
-	state = STATE_OFF;
-	printf ("off\n");
+}
+
+/* what one track does for [off, off+n) of this block, from pos in a
+   track len long.  Its port gets silence unless it's playing. */
+void run_track(int pedal, jack_default_audio_sample_t *in,
+	       jack_default_audio_sample_t *out,
+	       jack_default_audio_sample_t *track_out,
+	       int pos, int len, int off, int n)
+{
+  struct ring track = track_ring(pedal, len);
+
+  in += off;
+  out += off;
+  if (track_out) { track_out += off; }
+
+  if (pedal_states[pedal] == pSTATE_PLY) {
+    TRACE_BEGIN(t_mix);
+    if (fx_any_on(pedal) && track_out) {
+      memset (track_out, 0, n * sizeof(jack_default_audio_sample_t));
+      play_with_effects(pedal, track_out, track, pos, n);
+      for (int i = 0 ; i < n ; i++) {
+	out[i] += track_out[i];
       }
     }
+    else if (fx_any_on(pedal)) {
+      play_with_effects(pedal, out, track, pos, n);
+    }
+    else if (varispeed_on(pedal)) {
+      play_varispeed(pedal, track, pos, out, track_out, n, track_level(pedal));
+    }
     else {
-      if (pedal_states[mouse_press] == pSTATE_PLY) {
-	printf ("stopping %d\n", mouse_press);
-	pedal_states[mouse_press] = pSTATE_OFF;
-      }
-      else {
-	printf ("waiting to record secondary %d\n", mouse_press);
-	pedal_states[mouse_press] = pSTATE_WAIT_REC;
-      }
+      play_sparse(pedal, track, pos, out, track_out, n, track_level(pedal));
     }
+    TRACE_END(t_mix, "mix");
+    return;
+  }
+
+  if (track_out) { memset (track_out, 0, n * sizeof(jack_default_audio_sample_t)); }
+  if (pedal_states[pedal] == pSTATE_REC) {
+    TRACE_BEGIN(t_record);
+    ring_write(track, pos, in, n);
+    take_write(pedal, pos, len, in, n);
+    flight_note_rec(pedal, off, n, pos, len);
+    TRACE_END(t_record, "record");
   }
 }
 
-/**
- * The process callback for this JACK application is called in a
- * special realtime thread once for each audio cycle.
- *
- * Moves between states based on mouse actions, then does stuff to
- * input, output, and buffers depending on the current state.
- *
- */
-int process (jack_nframes_t nframes, void *arg)
+/* run the engine for one cycle: move between states based on the
+   pedals, then do stuff to input, output, and buffers depending on the
+   current state.  Everything here has to depend only on its arguments
+   and the engine state, so the flight recorder can replay it. */
+void run_cycle(jack_nframes_t nframes, jack_default_audio_sample_t *in,
+	       jack_default_audio_sample_t *out,
+	       jack_default_audio_sample_t **track_out,
+	       struct cycle_input *input)
 {
-	jack_default_audio_sample_t *in, *out;
-	in = jack_port_get_buffer (input_port, nframes);
-	out = jack_port_get_buffer (output_port, nframes);
-
-	/* move between states apropriately */
-	respond_to_mouse(get_mouse());
+	TRACE_BEGIN(t_state);
+	track_heads();
+	for (int c = 0 ; c < input->n_cmds ; c++) {
+	  do_command(&input->cmds[c]);
+	}
+	for (int b = 0 ; b < input->n_buttons ; b++) {
+	  gesture_event(input->buttons[b], frames_run);
+	}
+	gesture_poll(frames_run);
+	if (shed_update(nframes) == SHED_FX) {
+	  fx_resume();
+	}
+	fx_update(nframes);
+	varispeed_update();
+	track_heads();
+	TRACE_END(t_state, "state");
 
-	
+	TRACE_BEGIN(t_input);
 	for (int i = 0 ; i < nframes ; i++) {
 	  out[i] = in[i] / VOLUME_DECREASE;
 	}
+
+	/* any track ports that don't get run this cycle are cleared at
+	   the end */
+	int played[3] = {0, 0, 0};
+
+	/* always keep the input history, whatever state we're in */
+	ring_write(history_ring(), history_pos, in, nframes);
+	history_pos = (history_pos + nframes) % HISTORY_LEN;
+	TRACE_END(t_input, "input");
 	
 	if (state == STATE_OFF) { }
 	else
 	{
 	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	    int pos = heads[pedal].pos, len = heads[pedal].len;
+	    jack_default_audio_sample_t *port = track_out[pedal];
 
-	    if (loop_pos == 0 && pedal != primary) {
+	    /* where in this block the track comes round to its top, if it
+	       does.  Everything before that is done in the old state and
+	       everything after in the new one, so a take starts and ends
+	       on the exact frame. */
+	    int top = nframes;
+	    if (pos == 0) { top = 0; }
+	    else if (state == STATE_PLY && pos + nframes > len) { top = len - pos; }
+
+	    if (top > 0) {
+	      run_track(pedal, in, out, port, pos, len, 0, top);
+	    }
+	    if (top == nframes) {
+	      played[pedal] = 1;
+	      continue;
+	    }
+
+	    /* when following, even the primary waits for the top */
+	    if (pedal != primary ||
+		(sync_mode == SYNC_FOLLOWER && state == STATE_PLY)) {
 	      if (pedal_states[pedal] == pSTATE_WAIT_REC) {
 		printf ("recording secondary %d\n", pedal);
 		pedal_states[pedal] = pSTATE_REC;
+		track_recorded[pedal] = 0;
+		take_start(pedal);
 	      }
 	      else if (pedal_states[pedal] == pSTATE_REC) {
 		printf ("playing secondary %d\n", pedal);
                 pedal_states[pedal] = pSTATE_PLY;
+		track_recorded[pedal] = 1;
+		loudness_finish(pedal);
               }
 	    }
 
-	    if (pedal_states[pedal] == pSTATE_PLY) {
-	      for (int i = 0 ; i < nframes ; i++) {
-		out[i] += loop_bufs[AMT_MEM*pedal + loop_pos + i] / VOLUME_DECREASE;
-	      }
-	    }
-	    else if (pedal_states[pedal] == pSTATE_REC) {
-	      for (int i = 0 ; i < nframes ; i++) {
-		loop_bufs[AMT_MEM*pedal + loop_pos + i] = in[i];
-	      }
+	    /* and round again from the top.  Polymetric rounds aren't all
+	       the same length, so ask where the next one starts. */
+	    if (top > 0) {
+	      heads[pedal] = head_at(pedal, top);
 	    }
+	    run_track(pedal, in, out, port, heads[pedal].pos, heads[pedal].len,
+		      top, nframes - top);
+	    played[pedal] = 1;
+	  }
+	}
+
+	TRACE_BEGIN(t_limit);
+	limit(out, nframes);
+	TRACE_END(t_limit, "limiter");
 
+	for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	  if (track_out[pedal] && !played[pedal]) {
+	    memset (track_out[pedal], 0, nframes * sizeof(jack_default_audio_sample_t));
 	  }
 	}
+}
 
+/* move on to the next cycle */
+void advance_loop(jack_nframes_t nframes)
+{
+	frames_run += nframes;
 	loop_pos += nframes;
-	if (state == STATE_PLY && loop_pos >= loop_end) { loop_pos = 0 ;}
+	if ((state == STATE_PLY || following) && loop_pos >= loop_end) {
+	  loop_pos -= loop_end;
+	  loop_count++;
+	}
 	if (loop_pos >= AMT_MEM) { loop_pos -= AMT_MEM;}
+}
+
+/**
+ * The process callback for this JACK application is called in a
+ * special realtime thread once for each audio cycle.
+ *
+ * Reads the pedal and lines up with the leader if we're following,
+ * then runs the engine, with the flight recorder watching.
+ *
+ */
+int process (jack_nframes_t nframes, void *arg)
+{
+	long long cycle_start = now_ns();
+	TRACE_THREAD("process");
+	jack_default_audio_sample_t *in, *out;
+	in = jack_port_get_buffer (input_port, nframes);
+	out = jack_port_get_buffer (output_port, nframes);
+
+	/* where this cycle is in time */
+	TRACE_BEGIN(t_events);
+	jack_time_t cycle_us = jack_frames_to_time (client, jack_last_frame_time (client));
+	if (sync_mode == SYNC_FOLLOWER) {
+	  loop_pos += follow_leader(nframes, cycle_us);
+	}
+	struct cycle_input input;
+	input.n_buttons = read_buttons(input.buttons, MAX_BUTTON_EVENTS);
+	input.n_cmds = take_commands(input.cmds, MAX_CONTROL_CMDS);
+	cur_params = params;
+
+	/* the per track ports */
+	jack_default_audio_sample_t *track_out[3] = {NULL, NULL, NULL};
+	if (TRACK_PORTS) {
+	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	    track_out[pedal] = jack_port_get_buffer (track_ports[pedal], nframes);
+	  }
+	  memcpy (jack_port_get_buffer (dry_port, nframes), in,
+		  nframes * sizeof(jack_default_audio_sample_t));
+	}
+	TRACE_END(t_events, "events");
+
+	flight_begin(nframes, in, &input);
+	run_cycle(nframes, in, out, track_out, &input);
+	TRACE_BEGIN(t_flight);
+	flight_end(out, nframes);
+	TRACE_END(t_flight, "flight");
+
+	if (sync_mode == SYNC_LEADER) {
+	  struct loop_clock clock;
+	  clock.running = state == STATE_PLY;
+	  clock.loop_end = loop_end;
+	  clock.loop_top = cycle_us - (jack_time_t)loop_pos * 1000000 / SAMPLE_RATE;
+	  clock.period = loop_end * 1e6 / SAMPLE_RATE;
+	  clock.heard = cycle_us;
+	  publish_clock(&our_clock, &clock);
+	}
+
+	advance_loop(nframes);
+	publish_status();
+	cycles_done++;
+
+	cycle_ns += (now_ns() - cycle_start - cycle_ns) / 64;
+	TRACE_END(cycle_start, "process");
 
 	return 0;
 }
 
+/* run a flight recording back through the engine, writing what it
+   played to REPLAY_FILE and checking it against what we played at
+   the time */
+int replay(const char *fname)
+{
+	struct flight_header header;
+	struct flight_key key;
+	FILE *f = fopen(fname, "rb");
+
+	if (!f) {
+	  perror(fname);
+	  return 1;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, "LPFLIGHT", 8) ||
+	    header.sample_rate != SAMPLE_RATE || header.amt_mem != AMT_MEM ||
+	    header.history_len != HISTORY_LEN ||
+	    header.key_size != sizeof(struct flight_key) ||
+	    header.cycle_size != sizeof(struct flight_cycle)) {
+	  fprintf(stderr, "%s isn't a flight recording from this build\n", fname);
+	  return 1;
+	}
+	/* run_cycle() does some things differently when following.  No
+	   sync threads, though: the leader's clock is only used by
+	   process(), not replayed. */
+	sync_mode = header.sync_mode;
+
+	struct flight_cycle *cycles = malloc(header.n_cycles * sizeof(*cycles));
+	jack_default_audio_sample_t *input =
+	  malloc(header.n_frames * sizeof(jack_default_audio_sample_t));
+	if (!cycles || !input ||
+	    fread(&key, sizeof(key), 1, f) != 1 ||
+	    fread(loop_bufs, sizeof(jack_default_audio_sample_t), AMT_MEM*3, f) != AMT_MEM*3 ||
+	    fread(cycles, sizeof(*cycles), header.n_cycles, f) != header.n_cycles ||
+	    fread(input, sizeof(jack_default_audio_sample_t), header.n_frames, f) != header.n_frames) {
+	  fprintf(stderr, "%s is truncated\n", fname);
+	  return 1;
+	}
+	fclose(f);
+
+	/* put ourselves back how we were at the keyframe, including the
+	   input history leading up to it */
+	flight_load_key(&key);
+	ring_write(history_ring(), history_pos - HISTORY_LEN, input, HISTORY_LEN);
+
+	int max_nframes = 0;
+	for (long long c = 0 ; c < header.n_cycles ; c++) {
+	  if (cycles[c].nframes > max_nframes) { max_nframes = cycles[c].nframes; }
+	}
+	jack_default_audio_sample_t *out = calloc(max_nframes * 4, sizeof(*out));
+	jack_default_audio_sample_t *track_out[3] = {NULL, NULL, NULL};
+	if (TRACK_PORTS) {
+	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	    track_out[pedal] = out + max_nframes * (pedal + 1);
+	  }
+	}
+
+	FILE *raw = fopen(REPLAY_FILE, "wb");
+	if (!raw) {
+	  perror("open " REPLAY_FILE);
+	  return 1;
+	}
+
+	jack_default_audio_sample_t *in = input + HISTORY_LEN;
+	long long n_diff = 0, n_unhashed = 0;
+	for (long long c = 0 ; c < header.n_cycles ; c++) {
+	  struct flight_cycle *rec = &cycles[c];
+
+	  loop_pos = rec->loop_pos;
+	  loop_end = rec->loop_end;
+	  following = rec->following;
+	  cycle_ns = rec->cycle_ns;
+	  for (int fx = 0 ; fx < 3*MAX_FX ; fx++) {
+	    effects[fx / MAX_FX][fx % MAX_FX].want_on = (rec->fx_want >> fx) & 1;
+	  }
+	  cur_params = &rec->params;
+
+	  run_cycle(rec->nframes, in, out, track_out, &rec->input);
+	  advance_loop(rec->nframes);
+
+	  if (!rec->hashed) { n_unhashed++; }
+	  else if (flight_hash(out, rec->nframes) != rec->out_hash) {
+	    if (!n_diff) {
+	      printf("replay differs from the original at cycle %lld (%.3fs in)\n",
+		     c, (double)(rec->frame - key.frame) / SAMPLE_RATE);
+	    }
+	    n_diff++;
+	  }
+	  fwrite(out, sizeof(*out), rec->nframes, raw);
+	  in += rec->nframes;
+	}
+	fclose(raw);
+
+	printf("replayed %lld cycles into %s: ", header.n_cycles, REPLAY_FILE);
+	if (n_diff) { printf("%lld differ\n", n_diff); }
+	else { printf("bit exact\n"); }
+	if (n_unhashed) {
+	  printf("(%lld cycles weren't hashed, we were shedding load)\n", n_unhashed);
+	}
+	return n_diff != 0;
+}
+
+/* time every kernel this cpu can run on the same noise, and check they
+   all come out the same */
+#define BENCH_REPS 20000
+#define N_BENCHES 5
+const char *bench_names[N_BENCHES] = {"mix", "scale", "linear", "sinc", "range"};
+
+void bench_run(struct kernels *k, int b, float *in, float *out)
+{
+  double start = SINC_TAPS/2 + 0.3;
+
+  switch (b) {
+  case 0: k->mix(out, in, VS_BLOCK, 0.7); break;
+  case 1: k->scale(out, in, VS_BLOCK, 0.7); break;
+  case 2: k->linear(out, VS_BLOCK, in, start, 0.5); break;
+  case 3: k->sinc(out, VS_BLOCK, in, start, 0.5, sinc_table[0], SINC_PHASES); break;
+  case 4: k->range(in, VS_BLOCK, &out[0], &out[1]); break;
+  }
+}
+
+int bench()
+{
+  static float in[VS_WINDOW], out[VS_BLOCK], first[N_BENCHES][VS_BLOCK];
+  int ran = 0, differ = 0;
+
+  for (int i = 0 ; i < VS_WINDOW ; i++) {
+    in[i] = rand() / (float)RAND_MAX - 0.5;
+  }
+
+  printf("ns/sample  ");
+  for (int b = 0 ; b < N_BENCHES ; b++) { printf("%8s", bench_names[b]); }
+  printf("\n");
+  for (int k = 0 ; k < N_KERNELS ; k++) {
+    struct kernels *kernels = all_kernels[k];
+    printf("%c %-8s ", kernels == kern ? '*' : ' ', kernels->name);
+    if (!kernels->usable()) {
+      printf("  not on this cpu\n");
+      continue;
+    }
+    for (int b = 0 ; b < N_BENCHES ; b++) {
+      memset(out, 0, sizeof(out));
+      long long start = now_ns();
+      for (int r = 0 ; r < BENCH_REPS ; r++) {
+	bench_run(kernels, b, in, out);
+      }
+      printf("%8.3f", (double)(now_ns() - start) / BENCH_REPS / VS_BLOCK);
+
+      if (!ran) { memcpy(first[b], out, sizeof(out)); }
+      else if (memcmp(first[b], out, sizeof(out))) {
+	printf(" (differs!)");
+	differ = 1;
+      }
+    }
+    printf("\n");
+    ran = 1;
+  }
+  return differ;
+}
+
 /**
  * JACK calls this shutdown_callback if the server ever shuts down or
  * decides to disconnect the client.
@@ -262,11 +4004,21 @@ void jack_shutdown (void *arg)
 
 int main (int argc, char *argv[])
 {
-        if (argc != 2) {
-	  printf("Usage: %s mouse_dev_fname\n", argv[0]);
+	int replaying = argc > 1 && !strcmp(argv[1], "replay");
+	int benching = argc > 1 && !strcmp(argv[1], "bench");
+        if (argc < 2 || argc > 4 || (replaying && argc > 3) ||
+	    (benching && argc > 2) ||
+	    (!replaying && !benching && argc > 2 &&
+	     strcmp(argv[2], "leader") && strcmp(argv[2], "follower"))) {
+	  printf("Usage: %s mouse_dev_fname [leader|follower [iface_addr]]\n", argv[0]);
+	  printf("       %s replay [flight_file]\n", argv[0]);
+	  printf("       %s bench\n", argv[0]);
 	  printf("Example: %s /dev/input/mouse2\n", argv[0]);
+	  printf("Example: %s /dev/input/mouse2 follower 127.0.0.1\n", argv[0]);
+	  printf("Example: %s replay %s\n", argv[0], FLIGHT_FILE);
 	  exit(1);
         }
+	if (argc > 3) { sync_iface = argv[3]; }
 	
 
 	const char **ports;
@@ -275,6 +4027,31 @@ int main (int argc, char *argv[])
 	jack_options_t options = JackNullOption;
 	jack_status_t status;
 
+	/* get all our audio memory in place before we go realtime */
+	print_faults("at startup");
+	kernels_init();
+	if (benching) {
+	  varispeed_init();
+	  exit (bench());
+	}
+	if (!replaying) { lock_memory(); }
+	loop_bufs = alloc_audio_mem(AMT_MEM*3);
+	history = alloc_audio_mem(HISTORY_LEN);
+	limiter_init();
+	peaks_init();
+
+	/* set up the effects chains and find out what they cost */
+	for (int i = 0 ; i < sizeof(fx_setups) / sizeof(fx_setups[0]) ; i++) {
+	  fx_configure(&fx_setups[i]);
+	}
+	varispeed_init();
+	if (replaying) {
+	  exit (replay(argc > 2 ? argv[2] : FLIGHT_FILE));
+	}
+	fx_calibrate();
+	varispeed_calibrate();
+	flight_init();
+
 	/* open the mouse nonblocking.  We'll poll it each time we process a frame */
 	if ((mouse_fd = open(argv[1], O_RDONLY | O_NONBLOCK)) == -1){
 	  fprintf (stderr, "open mouse %s failed\n", argv[1]);
@@ -298,8 +4075,12 @@ int main (int argc, char *argv[])
 	/* tell the JACK server to call `process()' whenever
 	   there is work to be done.
 	*/
+	jack_set_thread_init_callback (client, thread_init, 0);
 	jack_set_process_callback (client, process, 0);
 
+	/* and `latency_callback()' so we can tell it about the limiter */
+	jack_set_latency_callback (client, latency_callback, 0);
+
 	/* tell the JACK server to call `jack_shutdown()' if
 	   it ever shuts down, either entirely, or if it
 	   just decides to stop calling us.
@@ -328,6 +4109,29 @@ int main (int argc, char *argv[])
 		exit (1);
 	}
 
+	if (TRACK_PORTS) {
+	  char name[32];
+	  for (int pedal = 0 ; pedal < 3 ; pedal++) {
+	    snprintf (name, sizeof(name), "track%d", pedal);
+	    track_ports[pedal] = jack_port_register (client, name,
+						     JACK_DEFAULT_AUDIO_TYPE,
+						     JackPortIsOutput, 0);
+	    if (track_ports[pedal] == NULL) {
+	      fprintf(stderr, "no more JACK ports available\n");
+	      exit (1);
+	    }
+	  }
+	  dry_port = jack_port_register (client, "dry",
+					 JACK_DEFAULT_AUDIO_TYPE,
+					 JackPortIsOutput, 0);
+	  if (dry_port == NULL) {
+	    fprintf(stderr, "no more JACK ports available\n");
+	    exit (1);
+	  }
+	}
+
+	print_faults("before activation");
+
 	/* Tell the JACK server that we are ready to roll.  Our
 	 * process() callback will start running now. */
 	if (jack_activate (client)) {
@@ -368,9 +4172,41 @@ int main (int argc, char *argv[])
 
 	free (ports);
 
-	/* keep running until stopped by the user */
+	print_faults("after activation");
+
+	if (argc > 2) {
+	  start_sync(strcmp(argv[2], "leader") ? SYNC_FOLLOWER : SYNC_LEADER);
+	}
+	start_control(client_name);
+
+	/* now that process() is running and measuring itself, ask for
+	   the effects we want on from the start */
+	sleep (1);
+	for (int i = 0 ; i < sizeof(fx_setups) / sizeof(fx_setups[0]) ; i++) {
+	  if (fx_setups[i].on) {
+	    effects[fx_setups[i].track][fx_setups[i].slot].want_on = 1;
+	  }
+	}
 
-	sleep (-1);
+	/* keep running until stopped by the user.  SIGUSR1 wakes us up
+	   early to write out a trace, SIGUSR2 the flight recorder. */
+
+	signal (SIGUSR1, trace_signal);
+	signal (SIGUSR2, flight_signal);
+	while (1) {
+	  sleep (FX_REPORT_SECONDS);
+	  flight_advance();
+	  if (trace_wanted) {
+	    trace_wanted = 0;
+	    dump_trace();
+	  }
+	  if (flight_wanted) {
+	    flight_wanted = 0;
+	    flight_dump();
+	  }
+	  print_fx_costs();
+	  print_limiter();
+	}
 
 	/* this is never reached but if the program
 	   had some other way to exit besides being killed,